@@ -12,6 +12,8 @@
 #include "AR488_GPIBbus.h"
 #include "AR488_ComPorts.h"
 #include "AR488_Eeprom.h"
+#include "AR488_Storage.h"
+#include "AR488_Trace.h"
 
 
 /***** FWVER "AR488 GPIB controller, ver. 0.53.04, 13/04/2025" *****/
@@ -155,19 +157,28 @@ static const char cmdHelp[] PROGMEM = {
   "eot_char:P Set character to append to USB output when EOT enabled\n"
   "eot_enable:P Enable/Disable appending user specified character to USB output on EOI detection\n"
   "help:P This message\n"
+  "hshist:P|C Handshake phase time histograms per address (on; off; clear), show addr,phase,counts per bucket (header gives bucket limits in us)\n"
   "ifc:P Assert IFC signal for 150 miscoseconds - make AR488 controller in charge\n"
   "llo:P Local lockout - disable front panel operation on instrument\n"
   "loc:P Enable front panel operation on instrument\n"
-  "lon:P Put controller in listen-only mode (listen to all traffic)\n"
+  "lon:P Put controller in listen-only mode (listen to all traffic); 2 [idle_ms]=buffered capture, reports bytes and duration after idle_ms without data\n"
+  "prom:P Promiscuous mode: 1=pass data to host, 2=capture all bytes with timestamps; dump returns capture in binary; clear\n"
+  "ptrig:P Capture trigger (tad n; lad n; cmd n; data str; srq; off; pre n; post n) and filter (filter off|atn|data|talker n), show trigger,filter\n"
   "mode:P Set the interface mode (1=controller/0=device)\n"
   "read:P Read data from instrument\n"
   "read_tmo_ms:P Read timeout specified between 1 - 3000 milliseconds\n"
   "rst:P Reset the controller\n"
   "savecfg:P Save configration\n"
-  "spoll:P Serial poll the addressed host or all instruments\n"
+  "spoll:P Serial poll the addressed host or all instruments ('stats' shows services,polls,polls per service x100)\n"
   "srq:P Return status of srq signal (1-srq asserted/0-srq not asserted)\n"
+  "stats:P|C Show and reset bus and host I/O counters (bytes, handshake timeouts by phase, IFC/ATN aborts, times the serial receive buffer was found full, command overflows, commands, loop time)\n"
   "status:P Set the status byte to be returned on being polled (bit 6 = RQS, i.e SRQ asserted)\n"
-  "trg:P Send trigger to selected devices (up to 15 addresses)\n"
+  "trace:P|C Record bus events in a trace buffer (mask: 1=receive 2=send 4=control 8=device ATN 16=addressing 32=commands 64=host lines, 0=off; clear; dump; mark n), show mask,records,lost\n"
+  "store:P|C Store bus data on SD card instead of sending it to the host (open n; close; erase n; dump n), list files, show file,bytes,blocks\n"
+  "talkq:P Queue a response to send when addressed to talk (add data; clear), show bytes queued\n"
+  "emu:P Answer queries without the host (add query|response; del n; clear), list table\n"
+  "maddr:P Answer on additional addresses (add pri [sec]; clear; sel n selects address for talkq/status), list addresses\n"
+  "trg:P Send a single group trigger to selected devices (up to 15 addresses)\n"
   "ver:P Display firmware version\n"
   "aspoll:C Serial poll all instruments (alias: ++spoll all)\n"
   "dcl:C Send unaddressed (all) device clear  [power on reset] (is the rst?)\n"
@@ -177,17 +188,32 @@ static const char cmdHelp[] PROGMEM = {
   "id serial:C Show/Set the serial number of the interface\n"
   "id verstr:C Show/Set the version string sent in reply to ++ver e.g. \"GPIB-USB\"). Max 47 chars, excess truncated.\n"
   "idn:C Enable/Disable reply to *idn? (disabled by default)\n"
-  "macro:C Run a macro (if macro support is compiled)\n"
-  "fndl:C Find listners\n"
+  "macro:C Run a macro (if macro support is compiled); def n records the following lines as macro n until ++macro end; del n; list n\n"
+  "loop:C In a stored macro, repeat the lines up to ++endloop (count [start [step]]); $i and $j are replaced by the loop indexes\n"
+  "endloop:C End of a ++loop in a stored macro\n"
+  "wait:C Wait for SRQ or a status byte (srq [tmo_ms] | stb mask [value] [tmo_ms])\n"
+  "delay:C Wait for a time (n milliseconds or nu microseconds)\n"
+  "fndl:C Find listners (all, range n-m or list of addresses; clear discards cached results)\n"
+  "busmap:C Show the map of listeners found by fndl (pri[:sec] [idn]); save; clear; idn; strict 0|1\n"
   "ppoll:C Conduct a parallel poll\n"
+  "ppd:C Disable the parallel poll response of a device\n"
+  "ppe:C Configure the parallel poll response of a device (addr line [sense]), or list configuration\n"
+  "ppu:C Unconfigure the parallel poll response of all devices\n"
   "ren:C Assert or Unassert the REN signal\n"
   "repeat:C Repeat a given command and return result\n"
+  "reduce:C Reduce repeated readings (0=off; stats n=count,mean,min,max,stddev of each n readings; every n=every nth reading)\n"
+  "lz:P|C Compress data received from the bus before sending it to the host (0=off; 1=on), show bytes in,out\n"
+  "binout:C Send readings to the host as binary frames (0=off; 1=float; 2 dec=fixed point x 10^dec) [batch]; flush\n"
+  "bench:C Throughput benchmark (write [size [reps [eoi|term|both]]]; read [reps [eoi|term|both [query]]]; host [size [reps]]), show bytes,time,bytes/s and for the bus handshakes/s,timeouts\n"
+  "sched:C Periodic sampling (start period_ms addr[,addr...] [count]; stop; query str), show samples,skipped,jitter max,mean (us)\n"
   "secread:C Read from a secondary address\n"
   "secsend:C Send data or command to a secondary address\n"
   "setvstr:C DEPRECATED - see id verstr\n"
-  "srqauto:C Automatically conduct serial poll when SRQ is asserted\n"
+  "srqauto:C Automatically conduct serial poll when SRQ is asserted (uses parallel poll when configured; 2=queue events if compiled)\n"
+  "sthist:C Show status byte history of a device (time,status) if compiled, or clear history\n"
+  "srqq:C Read and clear the queue of service request events (addr,status,time; addr -1 = requester not found)\n"
   "tct:C Signal remote device to take control\n"
-  "ton:C Put controller in talk-only mode (send data only)\n"
+  "ton:C Put controller in talk-only mode (send data only); 3 [eom]=burst mode with EOI on the eom character; stats shows bytes,ms,bytes/s,errors,lost\n"
   "unl:C Unlisten the GPIB bus\n"
   "unt:C Untalk the GPIB bus"
   "verbose:C Verbose (human readable) mode\n"
@@ -244,15 +270,246 @@ bool isPlusEscaped = false;   // Plus escaped
 
 // Read only mode flag
 bool isRO = false;
+#ifdef LON_BUFFER
+// Buffered listen-only capture (++lon 2)
+uint8_t lonBuf[LON_BUFFER];
+bool isLonBuf = false;
+uint16_t lonIdle = 2000;  // Idle time (ms) that ends a capture
+#endif
 
 // Talk only mode flag
 uint8_t isTO = 0;
+#ifdef TON_BUFFER
+// Buffered talk-only mode (++ton 3)
+#define TON_BURST 64        // Bytes written to the bus before checking the serial input
+#define TON_STALL 3         // Failed bursts after which data that does not fit is discarded
+struct tonRing {
+  uint8_t buf[TON_BUFFER];
+  uint16_t head;
+  uint16_t tail;
+  uint16_t cnt;
+  int16_t eom;              // End of message character sent with EOI (-1 = none)
+  bool bol;                 // At the beginning of a line (a ++ command may follow)
+  uint32_t bytes;           // Bytes sent
+  uint32_t tfirst;          // Time of the first and last byte sent (ms)
+  uint32_t tlast;
+  uint16_t errors;          // Bytes not accepted by the listeners in time
+  uint8_t stalls;           // Consecutive bursts not accepted
+  uint32_t lost;            // Bytes discarded while the buffer was full and stalled
+} ton;
+#endif
 
 // Data send mode flags
 bool dataBufferFull = false;    // Flag when parse buffer is full
 
-// SRQ auto mode
-bool isSrqa = false;
+// SRQ auto mode (0=off; 1=poll and print; 2=poll and queue)
+uint8_t isSrqa = 0;
+
+// SRQ assertion detected by interrupt and time of assertion
+volatile bool srqFlag = false;
+volatile unsigned long srqTstamp = 0;
+
+#ifdef SRQ_QUEUE_SIZE
+// Service request event queue (srqauto 2)
+#define SRQ_NOTFOUND 0xFF                   // Event address when no requester was found
+static const uint16_t SRQ_BACKOFF_MIN = 100;  // Delay before searching again after a failed search (ms)
+static const uint16_t SRQ_BACKOFF_MAX = 5000; // Doubled up to this after each failed search
+struct srqEvent {
+  unsigned long tstamp;   // Time (micros) at which SRQ was asserted
+  uint8_t addr;           // Address of requesting device (SRQ_NOTFOUND = none)
+  uint8_t sb;             // Status byte
+};
+srqEvent srqQueue[SRQ_QUEUE_SIZE];
+uint8_t srqqHead = 0;
+uint8_t srqqCnt = 0;
+uint16_t srqqLost = 0;
+uint16_t srqBackoff = 0;      // Current back-off after failed searches (ms)
+unsigned long srqRetry = 0;   // Time (millis) of the next search
+#endif
+
+// Adaptive serial poll order (allspoll and SRQ auto)
+static const uint8_t SPOLL_FAIR_LIMIT = 4;  // Max consecutive services before a device is polled last
+static const uint8_t SPOLL_DECAY = 32;      // Halve request history every n services
+uint8_t srqHits[31] = {0};    // Service request history per address
+uint8_t srqLastAddr = 0xFF;   // Last device serviced
+uint8_t srqRun = 0;           // Consecutive services of last device
+bool srqOthers = false;       // SRQ still asserted after the last service (another requester waiting)
+uint8_t srqDecayCnt = 0;
+uint32_t srqServiced = 0;     // Service requests found by polling
+uint32_t srqPolls = 0;        // Devices polled while looking for requesters
+
+#ifdef SPOLL_HISTORY
+// Status byte history per address
+struct stbHist {
+  unsigned long tstamp[SPOLL_HISTORY];  // Time (millis) status byte was first seen
+  uint8_t sb[SPOLL_HISTORY];            // Status byte
+  uint8_t head;                         // Oldest entry
+  uint8_t cnt;                          // Number of entries
+};
+stbHist stbHistory[31];
+#endif
+
+// Parallel poll configuration (PPE byte sent to each address, 0=not configured)
+uint8_t ppCfg[31] = {0};
+
+// Find listeners (fndl)
+static const uint16_t FNDL_NDAC_WAIT = 1600;  // Max time (us) for unaddressed devices to release NDAC
+#define FNDL_PRIMARY 0x80000000UL              // Listener found on the primary address
+
+// Bus topology map (results of fndl, optionally saved to EEPROM)
+struct busMapData {
+  uint32_t found[31];         // Listeners found per primary (bits 0-30 = secondary 0x60-0x7E)
+  uint32_t valid;             // Entry valid (primary has been scanned)
+  uint8_t strict;             // Refuse to address devices not found on the bus
+};
+busMapData busMap;
+#ifdef BUSMAP_IDN_LEN
+char busMapIdn[31][BUSMAP_IDN_LEN];   // *IDN? reply of device found on each primary
+#endif
+
+// Device mode addresses (0 = cfg.paddr, 1 onwards = devSlots)
+#ifdef MULTI_ADDR
+static const uint8_t DEV_SLOTS = MULTI_ADDR + 1;
+struct devSlot {
+  uint8_t pri;                // Primary address
+  uint8_t sec;                // Secondary address (0xFF = none)
+  uint8_t stat;               // Status byte returned on serial poll
+};
+devSlot devSlots[MULTI_ADDR];
+uint8_t devCnt = 0;           // Additional addresses configured
+#else
+static const uint8_t DEV_SLOTS = 1;
+#endif
+uint8_t devIdx = 0;           // Address the controller is communicating with
+uint8_t devSel = 0;           // Address the host is configuring (talkq, status)
+
+#ifdef TALK_QUEUE_SIZE
+// Device mode talk queue (response sent when addressed to talk)
+uint8_t talkQueue[DEV_SLOTS][TALK_QUEUE_SIZE];
+uint16_t tqLen[DEV_SLOTS] = {0};  // Bytes in queue
+uint16_t tqPtr[DEV_SLOTS] = {0};  // Bytes already sent
+#endif
+
+#ifdef EMU_ENTRIES
+// Device mode instrument emulation (query and canned response)
+struct emuEntry {
+  char query[EMU_QUERY_LEN];
+  char resp[EMU_RESP_LEN];
+};
+emuEntry emuTable[EMU_ENTRIES];
+uint8_t emuCnt = 0;           // Entries in table
+uint8_t emuResp = 0xFF;       // Entry to respond with when addressed to talk (0xFF = none)
+uint8_t emuSlot = 0;          // Address (devIdx) the matched query was received on
+#endif
+
+#ifdef PROM_CAPTURE
+// Promiscuous mode capture of bus traffic
+#define PROM_ATN 0x01         // Byte received with ATN asserted (command)
+#define PROM_EOI 0x02         // Byte received with EOI asserted
+struct promRec {
+  uint32_t tstamp;            // Time (micros) the handshake completed
+  uint8_t db;                 // Data byte
+  uint8_t flags;              // PROM_ATN, PROM_EOI
+};
+promRec promBuf[PROM_CAPTURE];
+uint16_t promHead = 0;        // Oldest record
+uint16_t promCnt = 0;         // Records in buffer
+uint16_t promLost = 0;        // Records overwritten since last dump
+bool promCap = false;         // Capture instead of passing data to the host
+
+// Capture trigger (only the window around the trigger is sent to the host)
+#define PTRIG_OFF 0
+#define PTRIG_TAD 1           // Talker address
+#define PTRIG_LAD 2           // Listener address
+#define PTRIG_CMD 3           // Command byte
+#define PTRIG_DATA 4          // Data pattern
+#define PTRIG_SRQ 5           // SRQ asserted
+static const uint8_t PTRIG_PATLEN = 8;
+uint8_t ptrigType = PTRIG_OFF;
+uint8_t ptrigVal = 0;         // Address or command byte
+char ptrigPat[PTRIG_PATLEN + 1];
+uint8_t ptrigFail[PTRIG_PATLEN + 1];  // Pattern characters still matched after a mismatch
+uint8_t ptrigPos = 0;         // Pattern characters matched
+uint16_t ptrigPre = 16;       // Records kept before the trigger
+uint16_t ptrigPost = 16;      // Records captured after the trigger
+uint16_t ptrigPostCnt = 0;
+bool ptrigFired = false;      // Capturing post-trigger records
+bool ptrigDone = false;       // Window complete, waiting to be sent
+
+// Capture filter (only matching records are captured)
+#define PFILT_OFF 0
+#define PFILT_ATN 1           // Commands only
+#define PFILT_DATA 2          // Data only
+#define PFILT_TALKER 3        // Data sent by one talker
+uint8_t pfiltType = PFILT_OFF;
+uint8_t pfiltVal = 0;         // Talker address
+uint8_t promTalker = 0xFF;    // Talker addressed on the bus (0xFF = none)
+#endif
+
+// Macros defined at runtime and stored in EEPROM
+#if defined(USE_MACROS) && defined(MACRO_STORE) && defined(E2END)
+#if (EE_MACROS + MACRO_STORE) <= (E2END + 1)
+#define MACRO_EEPROM
+#define MACRO_MAGIC 0xA5      // Store has been initialised
+#define MACRO_END 0xFF        // End of stored macros
+#define MACRO_DATA 0x7F       // Line is data to send to the instrument (otherwise command index)
+uint8_t macroRec = 0xFF;      // Macro being recorded (0xFF = none)
+uint16_t macroRecAddr = 0;    // Address of macro being recorded
+static const uint8_t SEQ_DEPTH = 4;   // Maximum nesting of ++loop in a stored macro
+#endif
+#endif
+
+// Sequence stopped (wait timeout or input from the host)
+bool seqAbort = false;
+
+// Main loop and host I/O statistics (++stats)
+struct loopStats {
+  uint32_t cmds;       // Commands executed
+  uint16_t rxFull;     // Times the serial receive buffer was found full
+  uint16_t pbOverflow; // Lines too long for the parse buffer
+  uint32_t loops;      // Loop iterations timed
+  uint32_t tmax;       // Longest loop iteration (us)
+  uint64_t tsum;       // Total time of the loop iterations (us)
+  uint32_t tprev;      // Start of the previous iteration (us)
+} lstats;
+
+// Readings converted to binary before being sent to the host
+NUMSTREAM numPort(dataPort);
+bool isBinOut = false;
+
+#ifdef EN_STORAGE
+// Storage of bus data on SD card
+AR488storage storage;
+#endif
+
+#ifdef LZ_WINDOW
+// Compression of data sent to the host
+LZSTREAM lzPort(dataPort);
+bool isLzOut = false;
+#endif
+
+// Reduction of repeated readings (see reduce_h)
+#define REDUCE_OFF   0
+#define REDUCE_STATS 1
+#define REDUCE_EVERY 2
+uint8_t reduceMode = REDUCE_OFF;
+uint16_t reduceCnt = 0;
+
+// Periodic acquisition scheduler
+static const uint8_t SCHED_ADDRS = 8;     // Maximum addresses sampled
+static const uint8_t SCHED_QLEN = 32;     // Maximum length of query
+uint8_t schedAddr[SCHED_ADDRS];
+uint8_t schedAcnt = 0;        // Addresses to sample
+char schedQuery[SCHED_QLEN] = "READ?";
+bool schedRun = false;
+uint32_t schedPeriod = 0;     // Sample period (us)
+uint32_t schedStart = 0;      // Time of first sample (micros)
+uint32_t schedNext = 0;       // Time sample is due (micros)
+uint32_t schedIdx = 0;        // Sample index
+uint32_t schedLimit = 0;      // Samples to take (0 = until stopped)
+uint32_t schedLateMax = 0;    // Maximum jitter (us)
+uint32_t schedLateSum = 0;    // Total jitter (us)
+uint16_t schedSkipped = 0;    // Samples missed (previous sample overran the period)
 
 // Whether to run Macro 0 (macros must be enabled)
 uint8_t runMacro = 0;
@@ -364,6 +621,8 @@ void setup() {
 //DB_RAW_PRINTLN(F("EEPROM data set to default."));
     }
   }
+  // Read the saved bus map
+  if (!epReadData((uint8_t*)&busMap, sizeof(busMap), EE_BUSMAP)) memset(&busMap, 0, sizeof(busMap));
 #endif
 
   // SN7516x IC support
@@ -398,6 +657,18 @@ void setup() {
   gpibBus.begin();
   if (gpibBus.cfg.hflags == 0xFF) gpibBus.cfg.hflags = 0;
 
+#ifdef EN_STORAGE
+  // Initialise the SD card
+  storage.begin(gpibBus);
+#endif
+
+#if defined(SRQ_INTERRUPT) && !defined(AR488_MCP23S17)
+  // Capture SRQ assertion (falling edge) with a pin interrupt
+  if (digitalPinToInterrupt(SRQ_PIN) != NOT_AN_INTERRUPT) {
+    attachInterrupt(digitalPinToInterrupt(SRQ_PIN), srqIsr, FALLING);
+  }
+#endif
+
 #if defined(USE_MACROS) && defined(RUN_STARTUP)
   // Run startup macro
   execMacro(0);
@@ -424,6 +695,16 @@ void setup() {
 void loop() {
 
   bool errFlg = false; 
+  uint32_t tnow = micros();
+  uint32_t tloop = tnow - lstats.tprev;
+
+  // Time of the last iteration
+  if (lstats.tprev) {
+    if (tloop > lstats.tmax) lstats.tmax = tloop;
+    lstats.tsum += tloop;
+    lstats.loops++;
+  }
+  lstats.tprev = tnow;
 
 /*** Macros ***/
 /*
@@ -456,6 +737,15 @@ if (lnRdy>0){
 }
 */
 
+#ifdef MACRO_EEPROM
+  // Recording a macro so store the line instead
+  if ( (macroRec != MACRO_END) && (lnRdy > 0) ) {
+    macroRecLine(pBuf, pbPtr, (lnRdy == 1));
+    flushPbuf();
+    lnRdy = 0;
+  }
+#endif
+
   // lnRdy=1: received a command so execute it...
   if (lnRdy == 1) {
     if (autoRead) {
@@ -476,14 +766,14 @@ if (lnRdy>0){
       // Auto-read data from GPIB bus following any command
       if (gpibBus.cfg.amode == 1) {
         gpibBus.addressDevice(gpibBus.cfg.paddr, gpibBus.cfg.saddr, TOTALK);
-        errFlg = gpibBus.receiveData(dataPort, gpibBus.cfg.eoi, false, 0);
+        errFlg = readToHost(gpibBus.cfg.eoi, false, 0);
         gpibBus.unAddressDevice();
       }
 
       // Auto-receive data from GPIB bus following a query command
       if (gpibBus.cfg.amode == 2 && isQuery) {
         gpibBus.addressDevice(gpibBus.cfg.paddr, gpibBus.cfg.saddr, TOTALK);
-        errFlg = gpibBus.receiveData(dataPort, gpibBus.cfg.eoi, false, 0);
+        errFlg = readToHost(gpibBus.cfg.eoi, false, 0);
         isQuery = false;
         gpibBus.unAddressDevice();
       }
@@ -495,13 +785,23 @@ if (lnRdy>0){
       // Nothing is waiting on the serial input so read data from GPIB
       if (lnRdy==0) {
         if (gpibBus.haveAddressedDevice() == TONONE) gpibBus.addressDevice(gpibBus.cfg.paddr, gpibBus.cfg.saddr, TOTALK);
-        errFlg = gpibBus.receiveData(dataPort, readWithEoi, readWithEndByte, endByte);
+        errFlg = readToHost(readWithEoi, readWithEndByte, endByte);
       }
     }
 
+    // Periodic acquisition due?
+    if (schedRun && ((int32_t)(micros() - schedNext) >= 0)) schedService();
+
     // Automatic serial poll (check status of SRQ and SPOLL if asserted)?
     if (isSrqa) {
-      if (gpibBus.isAsserted(SRQ_PIN)) spoll_h(NULL);
+      if (gpibBus.isAsserted(SRQ_PIN)) {
+        srqService();
+      }else if (srqFlag) {
+        // Edge without SRQ asserted (glitch or request withdrawn)
+        noInterrupts();
+        if (!gpibBus.isAsserted(SRQ_PIN)) srqFlag = false;
+        interrupts();
+      }
     }
 
     // Did we get an error during read?
@@ -546,7 +846,13 @@ if (lnRdy>0){
 */
 
   // If charaters waiting in the serial input buffer then call handler
-  if (dataPort.available()) lnRdy = serialIn_h();
+  if (dataPort.available()) {
+#ifdef SERIAL_RX_BUFFER_SIZE
+    // Characters may have been lost if the receive buffer is full
+    if (dataPort.available() >= (SERIAL_RX_BUFFER_SIZE - 1)) lstats.rxFull++;
+#endif
+    lnRdy = serialIn_h();
+  }
 
   delayMicroseconds(5);
 }
@@ -590,6 +896,7 @@ uint8_t serialIn_h() {
     DB_PRINT(F("bufferStatus: "), bufferStatus);
   }
 #endif
+  if (bufferStatus) TRACE(TRC_SERIAL, TE_LINE, bufferStatus, pbPtr);
 
   return bufferStatus;
 }
@@ -703,6 +1010,7 @@ uint8_t parseInput(char c) {
   }
   if (pbPtr >= PBSIZE) {
     if (isCmd(pBuf) && !r) {  // Command without terminator and buffer full
+      lstats.pbOverflow++;
       if (isVerb) {
         dataPort.println(F("ERROR - Command buffer overflow!"));
       }
@@ -801,9 +1109,15 @@ static cmdRec cmdHidx [] = {
   { "addr",        3, addr_h      }, 
   { "allspoll",    2, (void(*)(char*)) aspoll_h  },
   { "auto",        2, amode_h     },
+  { "bench",       2, bench_h     },
+  { "binout",      2, binout_h    },
+  { "busmap",      2, busmap_h    },
   { "clr",         2, (void(*)(char*)) clr_h     },
   { "dcl",         2, (void(*)(char*)) dcl_h     },
   { "default",     3, (void(*)(char*)) default_h },
+  { "delay",       3, delay_h     },
+  { "emu",         1, emu_h       },
+  { "endloop",     3, endloop_h   },
   { "eoi",         3, eoi_h       },
   { "eor",         3, eor_h       },
   { "eos",         3, eos_h       },
@@ -812,35 +1126,52 @@ static cmdRec cmdHidx [] = {
   { "flags",       2, hflags_h    },
   { "fndl",        2, fndl_h      },
   { "help",        3, help_h      },
+  { "hshist",      3, hshist_h    },
   { "ifc",         2, (void(*)(char*)) ifc_h     },
   { "id",          3, id_h        },
   { "idn",         3, idn_h       },
   { "llo",         2, llo_h       },
   { "loc",         2, loc_h       },
   { "lon",         1, lon_h       },
+  { "loop",        3, loop_h      },
+  { "lz",          3, lz_h        },
+  { "maddr",       1, maddr_h     },
   { "macro",       2, macro_h     },
   { "mode" ,       3, cmode_h     },
+  { "ppd",         2, ppd_h       },
+  { "ppe",         2, ppe_h       },
   { "ppoll",       2, (void(*)(char*)) ppoll_h   },
+  { "ppu",         2, (void(*)(char*)) ppu_h     },
   { "prom",        1, prom_h      },
+  { "ptrig",       1, ptrig_h     },
   { "read",        2, read_h      },
   { "read_tmo_ms", 2, rtmo_h      },
+  { "reduce",      2, reduce_h    },
   { "ren",         2, ren_h       },
   { "repeat",      2, repeat_h    },
   { "rst",         3, (void(*)(char*)) rst_h     },
   { "trg",         2, trg_h       },
   { "savecfg",     3, (void(*)(char*)) save_h    },
 //  { "secread",     2, secread_h   },
+  { "sched",       2, sched_h     },
   { "send",        2, send_h      },
   { "setvstr",     3, setvstr_h   },
   { "spoll",       2, spoll_h     },
   { "srq",         2, (void(*)(char*)) srq_h     },
   { "srqauto",     2, srqa_h      },
+  { "srqq",        2, (void(*)(char*)) srqq_h    },
+  { "stats",       3, (void(*)(char*)) stats_h   },
   { "status",      1, stat_h      },
+  { "sthist",      2, sthist_h    },
+  { "store",       3, store_h     },
+  { "talkq",       1, talkq_h     },
   { "tct",         2, tct_h       },
+  { "trace",       3, trace_h     },
   { "ton",         1, ton_h       },
   { "unl",         2, (void(*)(char*)) unlisten_h  },
   { "unt",         2, (void(*)(char*)) untalk_h    },
   { "ver",         3, ver_h       },
+  { "wait",        2, wait_h      },
   { "verbose",     3, (void(*)(char*)) verb_h    },
   { "xdiag",       3, xdiag_h     }
 };
@@ -932,6 +1263,17 @@ void execCmd(char *buffr, uint8_t dsize) {
 }
 
 
+/***** Count and trace a command about to be executed *****/
+/*
+ * Called for commands from the host and for command lines of stored
+ * macros so that ++stats and ++trace see both
+ */
+void cmdRecord(uint8_t idx) {
+  lstats.cmds++;
+  TRACE(TRC_COMMAND, TE_COMMAND, idx, 0);
+}
+
+
 /***** Extract command and pass to handler *****/
 void getCmd(char *buffr) {
 
@@ -972,6 +1314,7 @@ void getCmd(char *buffr) {
 #endif
     // If command is relevant to mode then execute it
     if (cmdHidx[i].opmode & gpibBus.cfg.cmode) {
+      cmdRecord(i);
       // If its a command with parameters
       // Copy command parameters to params and call handler with parameters
       params = token + strlen(token) + 1;
@@ -1091,6 +1434,11 @@ void execMacro(uint8_t idx) {
   const char * macro = pgm_read_word(macros + idx);
   int ssize = strlen_P(macro);
 
+#ifdef MACRO_EEPROM
+  // A macro stored in EEPROM replaces the compiled macro
+  if (execStoredMacro(idx)) return;
+#endif
+
   // Read characters from macro character array
   for (int i = 0; i < ssize; i++) {
     c = pgm_read_byte_near(macro + i);
@@ -1131,6 +1479,287 @@ void execMacro(uint8_t idx) {
 #endif
 
 
+#ifdef MACRO_EEPROM
+/*
+ * Stored macros (EEPROM from EE_MACROS):
+ * MACRO_MAGIC, number of commands in cmdHidx, then macro records:
+ * macro number, length (2 bytes), lines. Each line is a type byte
+ * (cmdHidx index of the command or MACRO_DATA) followed by the
+ * parameters or data and a null. The records end with MACRO_END.
+ * Commands are stored as their cmdHidx index so that they do not need
+ * to be looked up again when the macro is run. The store is discarded
+ * if the number of commands changes (i.e. different firmware).
+ */
+
+/***** Check the macro store and initialise if required *****/
+void macroStoreInit() {
+  uint8_t ccnt = sizeof(cmdHidx) / sizeof(cmdHidx[0]);
+  if ( (epReadByte(EE_MACROS) != MACRO_MAGIC) || (epReadByte(EE_MACROS + 1) != ccnt) ) {
+    epWriteByte(EE_MACROS, MACRO_MAGIC);
+    epWriteByte(EE_MACROS + 1, ccnt);
+    epWriteByte(EE_MACROS + 2, MACRO_END);
+  }
+}
+
+
+/***** Return the address of a stored macro (0 if not found) or of the end marker *****/
+uint16_t macroFind(uint8_t num) {
+  uint16_t addr = EE_MACROS + 2;
+  uint8_t mnum;
+  if ( (epReadByte(EE_MACROS) != MACRO_MAGIC) || (epReadByte(EE_MACROS + 1) != (sizeof(cmdHidx) / sizeof(cmdHidx[0]))) ) return 0;
+  while (addr < (EE_MACROS + MACRO_STORE)) {
+    mnum = epReadByte(addr);
+    if (mnum == num) return addr;
+    if (mnum == MACRO_END) return 0;
+    addr += 3 + epReadByte(addr + 1) + (epReadByte(addr + 2) << 8);
+  }
+  return 0;
+}
+
+
+/***** Delete a stored macro *****/
+void macroDelete(uint8_t num) {
+  uint16_t addr = macroFind(num);
+  uint16_t endaddr = macroFind(MACRO_END);
+  uint16_t rlen;
+  if (!addr || !endaddr) return;
+  rlen = 3 + epReadByte(addr + 1) + (epReadByte(addr + 2) << 8);
+  // Move the following records (and end marker) down
+  for (uint16_t i = addr + rlen; i <= endaddr; i++) {
+    epWriteByte(i - rlen, epReadByte(i));
+  }
+}
+
+
+/***** Store a line received while recording a macro *****/
+void macroRecLine(char *line, uint8_t len, bool isCommand) {
+  uint8_t type = MACRO_DATA;
+  uint8_t ccnt = sizeof(cmdHidx) / sizeof(cmdHidx[0]);
+  uint16_t mlen;
+  uint16_t addr;
+  char *token;
+  char *params = line;
+
+  line[len] = '\0';
+
+  if (isCommand) {
+    // Look up the command (skip the ++)
+    token = strtok(line + 2, " \t");
+    if (token == NULL) return;
+    params = token + strlen(token);
+    if ((uint8_t)(params - line) < len) params++;
+    // End of macro?
+    if ( (strcasecmp(token, "macro") == 0) && (strncasecmp(params, "end", 3) == 0) ) {
+      if (isVerb) {
+        dataPort.print(F("Macro "));
+        dataPort.print(macroRec);
+        dataPort.println(F(" saved."));
+      }
+      macroRec = MACRO_END;
+      return;
+    }
+    for (type = 0; type < ccnt; type++) {
+      if (strcasecmp(cmdHidx[type].token, token) == 0) break;
+    }
+    if (type == ccnt) {
+      errorMsg(0);
+      return;
+    }
+  }
+
+  // Append line (type, text, null) and move the end marker
+  mlen = epReadByte(macroRecAddr + 1) + (epReadByte(macroRecAddr + 2) << 8);
+  addr = macroRecAddr + 3 + mlen;
+  len = strlen(params);
+  if ( (addr + len + 3) > (EE_MACROS + MACRO_STORE) ) {
+    dataPort.println(F("Macro storage full!"));
+    return;
+  }
+  epWriteByte(addr++, type);
+  for (uint8_t i = 0; i <= len; i++) {
+    epWriteByte(addr++, params[i]);
+  }
+  epWriteByte(addr, MACRO_END);
+  mlen += len + 2;
+  epWriteByte(macroRecAddr + 1, mlen & 0xFF);
+  epWriteByte(macroRecAddr + 2, mlen >> 8);
+}
+
+
+/***** Read a stored macro line into the parse buffer *****/
+/*
+ * Returns the line type and the address of the next line
+ */
+uint8_t macroReadLine(uint16_t *addr) {
+  uint8_t type = epReadByte((*addr)++);
+  char c;
+  flushPbuf();
+  while ( (c = epReadByte((*addr)++)) != '\0' ) {
+    if (pbPtr < (PBSIZE - 1)) addPbuf(c);
+  }
+  return type;
+}
+
+
+/***** Run a stored macro *****/
+/*
+ * Returns false if the macro is not stored
+ */
+bool execStoredMacro(uint8_t num) {
+  uint16_t addr = macroFind(num);
+  uint16_t endaddr;
+  uint8_t type;
+  uint8_t depth = 0;
+  uint8_t nest;
+  uint16_t loopAddr[SEQ_DEPTH];   // First line of loop
+  uint16_t loopLeft[SEQ_DEPTH];   // Repetitions remaining
+  int16_t loopIdx[SEQ_DEPTH];     // Loop index
+  int16_t loopStep[SEQ_DEPTH];
+  char *param;
+
+  if (!addr) return false;
+  endaddr = addr + 3 + epReadByte(addr + 1) + (epReadByte(addr + 2) << 8);
+  addr += 3;
+  seqAbort = false;
+
+  while ( (addr < endaddr) && !seqAbort ) {
+    type = macroReadLine(&addr);
+
+    // Substitute loop indexes
+    if (depth) seqSubst(loopIdx[depth-1], (depth > 1) ? loopIdx[depth-2] : 0);
+
+    if ( (type != MACRO_DATA) && (cmdHidx[type].opmode & gpibBus.cfg.cmode) ) cmdRecord(type);
+
+    if (type == MACRO_DATA) {
+      sendToInstrument(pBuf, pbPtr);
+
+    }else if (cmdHidx[type].handler == loop_h) {
+      // Start of loop: count [start [step]]
+      if (depth == SEQ_DEPTH) {
+        dataPort.println(F("Loops nested too deep!"));
+        break;
+      }
+      param = strtok(pBuf, " ,\t");
+      loopLeft[depth] = param ? strtoul(param, NULL, 10) : 0;
+      param = strtok(NULL, " ,\t");
+      loopIdx[depth] = param ? atoi(param) : 0;
+      param = strtok(NULL, " ,\t");
+      loopStep[depth] = param ? atoi(param) : 1;
+      loopAddr[depth] = addr;
+      if (loopLeft[depth]) {
+        depth++;
+      }else{
+        // No repetitions so skip to the matching ++endloop
+        nest = 1;
+        while ( (addr < endaddr) && nest ) {
+          type = macroReadLine(&addr);
+          if (type == MACRO_DATA) continue;
+          if (cmdHidx[type].handler == loop_h) nest++;
+          if (cmdHidx[type].handler == endloop_h) nest--;
+        }
+      }
+
+    }else if (cmdHidx[type].handler == endloop_h) {
+      // Repeat or end loop
+      if (!depth) continue;
+      loopLeft[depth-1]--;
+      if (loopLeft[depth-1]) {
+        loopIdx[depth-1] += loopStep[depth-1];
+        addr = loopAddr[depth-1];
+        // Input from the host stops the sequence
+        if (dataPort.available()) seqAbort = true;
+      }else{
+        depth--;
+      }
+
+    }else if (cmdHidx[type].opmode & gpibBus.cfg.cmode) {
+      cmdHidx[type].handler(pbPtr ? pBuf : NULL);
+    }
+  }
+
+  flushPbuf();
+  return true;
+}
+
+
+/***** Replace $i and $j in the parse buffer with loop indexes *****/
+void seqSubst(int16_t idxi, int16_t idxj) {
+  char line[PBSIZE];
+  char num[7];
+  uint8_t len = 0;
+  uint8_t nlen;
+
+  if (strchr(pBuf, '$') == NULL) return;
+
+  for (uint8_t i = 0; i < pbPtr; i++) {
+    if ( (pBuf[i] == '$') && ((pBuf[i+1] == 'i') || (pBuf[i+1] == 'j')) ) {
+      nlen = sprintf(num, "%d", (pBuf[i+1] == 'i') ? idxi : idxj);
+      if ((len + nlen) >= PBSIZE) break;
+      memcpy(line + len, num, nlen);
+      len += nlen;
+      i++;
+    }else{
+      if ((len + 1) >= PBSIZE) break;
+      line[len++] = pBuf[i];
+    }
+  }
+  line[len] = '\0';
+  memcpy(pBuf, line, len + 1);
+  pbPtr = len;
+}
+
+
+/***** List the lines of a stored macro *****/
+void macroList(uint8_t num) {
+  uint16_t addr = macroFind(num);
+  uint16_t endaddr;
+  uint8_t type;
+
+  if (!addr) return;
+  endaddr = addr + 3 + epReadByte(addr + 1) + (epReadByte(addr + 2) << 8);
+  addr += 3;
+
+  while (addr < endaddr) {
+    type = macroReadLine(&addr);
+    if (type != MACRO_DATA) {
+      dataPort.print(F("++"));
+      dataPort.print(cmdHidx[type].token);
+      if (pbPtr) dataPort.print(' ');
+    }
+    dataPort.println(pBuf);
+  }
+  flushPbuf();
+}
+#endif
+
+
+/***** Read data from the addressed device and send it to the host *****/
+/*
+ * Data is stored on SD card instead while a file is open (++store).
+ * Readings are converted to binary frames when enabled with ++binout,
+ * otherwise compressed when enabled with ++lz
+ */
+bool readToHost(bool detectEoi, bool detectEndByte, uint8_t endByte) {
+  bool err;
+#ifdef EN_STORAGE
+  if (storage.isOpen()) return gpibBus.receiveData(storage, detectEoi, detectEndByte, endByte);
+#endif
+  if (isBinOut) {
+    err = gpibBus.receiveData(numPort, detectEoi, detectEndByte, endByte);
+    numPort.endResponse();
+    return err;
+  }
+#ifdef LZ_WINDOW
+  if (isLzOut) {
+    err = gpibBus.receiveData(lzPort, detectEoi, detectEndByte, endByte);
+    lzPort.endBlock();
+    return err;
+  }
+#endif
+  return gpibBus.receiveData(dataPort, detectEoi, detectEndByte, endByte);
+}
+
+
 /*************************************/
 /***** STANDARD COMMAND HANDLERS *****/
 /*************************************/
@@ -1155,10 +1784,9 @@ void addr_h(char *params) {
       if (isVerb) dataPort.println(F("Cannot address the controller!"));
       return;
     }
-    gpibBus.cfg.paddr = val;
 
     // Secondary address
-    gpibBus.cfg.saddr = 0xFF; // Default
+    saddr = 0xFF; // Default
     param = strtok(NULL, ", \t");
 //    Serial.println(param);
     if (param != NULL) {
@@ -1173,9 +1801,14 @@ void addr_h(char *params) {
         errorMsg(2);
         return;
       }
-      gpibBus.cfg.saddr = saddr;
     }
 
+    // Was a device found at the address?
+    if (gpibBus.isController() && !busMapCheck(val, saddr)) return;
+
+    gpibBus.cfg.paddr = val;
+    gpibBus.cfg.saddr = saddr;
+
     if (isVerb) {
       dataPort.print(F("PRI address set to: "));
       dataPort.println(gpibBus.cfg.paddr);
@@ -1384,6 +2017,9 @@ void read_h(char *params) {
         sec = 0xFF;
       }
 
+      // Was a device found at the address?
+      if (!busMapCheck(pri, sec)) return;
+
     }
     
     // Check for eoi or terminator character
@@ -1410,7 +2046,7 @@ void read_h(char *params) {
     autoRead = true;
   } else {
     // If auto mode is disabled we do a single read
-    gpibBus.receiveData(dataPort, readWithEoi, readWithEndByte, endByte);
+    readToHost(readWithEoi, readWithEndByte, endByte);
     gpibBus.unAddressDevice();
     if ( !autoRead && (gpibBus.cfg.hflags & 0x02) ) dataPort.println(F("Read^OK"));
   }
@@ -1497,6 +2133,7 @@ void trg_h(char *params) {
   uint8_t addrs[maxparam] = {0};
   uint16_t val = 0;
   uint8_t cnt = 0;
+  unsigned long getTime = 0;
 
   addrs[0] = addrs[0]; // Meaningless as both are zero but defaults compiler warning!
 
@@ -1525,18 +2162,26 @@ void trg_h(char *params) {
 
   // If we have some addresses to trigger....
   if (cnt > 0) {
-    for (int i = 0; i < cnt; i++) {
-      // Sent GET to the requested device
-      if (gpibBus.sendGET(addrs[i]))  {
-        if (isVerb) dataPort.println(F("Failed to trigger device!"));
-        return;
-      }
+    // Address all devices to listen then send a single GET
+    if (gpibBus.sendGroupGET(addrs, cnt, &getTime))  {
+      if (isVerb) dataPort.println(F("Failed to trigger device!"));
+      return;
     }
 
     // Set GPIB controls back to idle state
     gpibBus.setControls(CIDS);
 
-    if (isVerb) dataPort.println(F("Group trigger completed."));
+    // Show time at which GET was sent
+    if (gpibBus.cfg.hflags & 0x08) {
+      dataPort.print(F("Trg^"));
+      dataPort.println(getTime);
+    }
+
+    if (isVerb) {
+      dataPort.print(F("Group trigger completed at "));
+      dataPort.print(getTime);
+      dataPort.println(F(" us."));
+    }
   }
 }
 
@@ -1575,12 +2220,12 @@ void rst_h() {
 void spoll_h(char *params) {
   char *param;
   uint8_t addrs[15];
+  uint8_t order[31];
   uint8_t sb = 0;
-  enum gpibHandshakeStates state;
   uint8_t j = 0;
+  uint8_t polls = 0;
   uint16_t addrval = 0;
   bool all = false;
-  bool eoiDetected = false;
 
   // Initialise address array
   for (int i = 0; i < 15; i++) {
@@ -1595,12 +2240,19 @@ void spoll_h(char *params) {
   }
 
   // ALL parameter given?
-  if (strncasecmp(params, "all", 3) == 0) {
+  if (params != NULL && strncasecmp(params, "all", 3) == 0) {
     all = true;
-    j = 30;
+    // Most frequent requesters are polled first
+    j = spollOrder(order);
     if (isVerb) dataPort.println(F("Serial poll of all devices requested..."));
   }
 
+  // Polls per service request (adaptive poll order)
+  if (params != NULL && strncasecmp(params, "stats", 5) == 0) {
+    spollStats();
+    return;
+  }
+
   if (j == 0) {
 
     // Read address parameters into array
@@ -1638,36 +2290,15 @@ void spoll_h(char *params) {
 
   }
 
-  // Send Unlisten [UNL] to all devices
-  if ( gpibBus.sendCmd(GC_UNL) )  {
-#ifdef DEBUG_SPOLL
-    DB_PRINT(F("failed to send UNL"),"");
-#endif
-    return;
-  }
-
-  // Controller addresses itself as listner
-  if ( gpibBus.sendCmd(GC_LAD + gpibBus.cfg.caddr) )  {
-#ifdef DEBUG_SPOLL
-    DB_PRINT(F("failed to send LAD"),"");
-#endif
-    return;
-  }
-
-  // Send Serial Poll Enable [SPE] to all devices
-  if ( gpibBus.sendCmd(GC_SPE) )  {
-#ifdef DEBUG_SPOLL
-    DB_PRINT(F("failed to send SPE"),"");
-#endif
-    return;
-  }
+  // Start the serial poll
+  if (spollBegin()) return;
 
   // Poll GPIB address or addresses as set by i and j
   for (int i = 0; i < j; i++) {
 
     // Set GPIB address in val
     if (all) {
-      addrval = i;
+      addrval = order[i];
     } else {
       addrval = addrs[i];
     }
@@ -1675,34 +2306,18 @@ void spoll_h(char *params) {
     // Don't need to poll own address
     if (addrval != gpibBus.cfg.caddr) {
 
-      // Address a device to talk
-      if ( gpibBus.sendCmd(GC_TAD + addrval) )  {
-
-#ifdef DEBUG_SPOLL
-        DB_PRINT(F("failed to send TAD"),"");
-#endif
-        return;
-      }
-
-      // Set GPIB control to controller active listner state (ATN unasserted), clear databus and set to input
-      gpibBus.setControls(CLAS);
-      gpibBus.clearDataBus();
-
-      // Read the response byte (usually device status) using handshake - suppress EOI detection
-      state = gpibBus.readByte(&sb, false, &eoiDetected);
+      polls++;
 
       // If we successfully read a byte
-      if (state == HANDSHAKE_COMPLETE) {
-
-        // Set GPIB control back to controller active talk state (ATN asserted) 
-        gpibBus.setControls(CTAS);
+      if (spollDevice(addrval, &sb) == OK) {
 
         // Process response
-        if (j == 30) {
+        if (all) {
           // If all, return specially formatted response: SRQ:addr,status
           // but only when RQS bit set
           if (sb & 0x40) {
-            dataPort.print(F("SRQ:")); dataPort.print(i); dataPort.print(F(",")); dataPort.println(sb, DEC);
+            dataPort.print(F("SRQ:")); dataPort.print(addrval); dataPort.print(F(",")); dataPort.println(sb, DEC);
+            srqRecord(addrval);
             // Exit on first device to respond
             i = j;
           }
@@ -1726,57 +2341,423 @@ void spoll_h(char *params) {
       }
     }
   }
-  if (all) dataPort.println();
+  if (all) {
+    dataPort.println();
+    srqPolls += polls;
+  }
 
-  // Send Serial Poll Disable [SPD] to all devices
-  if ( gpibBus.sendCmd(GC_SPD) )  {
+  // End the serial poll and return bus to idle
+  if (spollEnd()) return;
+
+  if (isVerb) dataPort.println(F("Serial poll completed."));
+
+}
+
+
+/***** Start a serial poll *****/
+/*
+ * Unlisten the bus, address the controller to listen and
+ * send serial poll enable (SPE) to all devices
+ */
+bool spollBegin() {
+
+  // Send Unlisten [UNL] to all devices
+  if ( gpibBus.sendCmd(GC_UNL) )  {
 #ifdef DEBUG_SPOLL
-    DB_PRINT(F("failed to send SPD"),"");
+    DB_PRINT(F("failed to send UNL"),"");
 #endif
-    return;
+    return ERR;
   }
 
-  // Send Untalk [UNT] to all devices
-  if ( gpibBus.sendCmd(GC_UNT) )  {
+  // Controller addresses itself as listner
+  if ( gpibBus.sendCmd(GC_LAD + gpibBus.cfg.caddr) )  {
 #ifdef DEBUG_SPOLL
-    DB_PRINT(F("failed to send UNT"),"");
+    DB_PRINT(F("failed to send LAD"),"");
 #endif
-    return;
+    return ERR;
   }
 
-  // Unadress listners [UNL] to all devices
-  if ( gpibBus.sendCmd(GC_UNL) )  {
+  // Send Serial Poll Enable [SPE] to all devices
+  if ( gpibBus.sendCmd(GC_SPE) )  {
 #ifdef DEBUG_SPOLL
-    DB_PRINT(F("failed to send UNL"),"");
+    DB_PRINT(F("failed to send SPE"),"");
 #endif
-    return;
+    return ERR;
   }
 
-  // Set GPIB control to controller idle state
-  gpibBus.setControls(CIDS);
+  return OK;
+}
 
-  if (isVerb) dataPort.println(F("Serial poll completed."));
 
-}
+/***** Read the status byte of a single device during a serial poll *****/
+bool spollDevice(uint8_t addr, uint8_t *sb) {
+  enum gpibHandshakeStates state;
+  bool eoiDetected = false;
 
+  // Address a device to talk
+  if ( gpibBus.sendCmd(GC_TAD + addr) )  {
+#ifdef DEBUG_SPOLL
+    DB_PRINT(F("failed to send TAD"),"");
+#endif
+    return ERR;
+  }
 
-/***** Return status of SRQ line *****/
-void srq_h() {
-  //NOTE: LOW=asserted=true=1, HIGH=unasserted=false=0
-  dataPort.println(gpibBus.isAsserted(SRQ_PIN));
+  // Set GPIB control to controller active listner state (ATN unasserted), clear databus and set to input
+  gpibBus.setControls(CLAS);
+  gpibBus.clearDataBus();
+
+  // Read the response byte (usually device status) using handshake - suppress EOI detection
+  state = gpibBus.readByte(sb, false, &eoiDetected);
+
+  if (state != HANDSHAKE_COMPLETE) return ERR;
+
+  // Set GPIB control back to controller active talk state (ATN asserted) 
+  gpibBus.setControls(CTAS);
+
+#ifdef SPOLL_HISTORY
+  // Record status byte in history
+  stbRecord(addr, *sb);
+#endif
+
+  return OK;
 }
 
 
-/***** Set the status byte (device mode) *****/
-void stat_h(char *params) {
-  uint16_t statusByte = 0;
+#ifdef SPOLL_HISTORY
+/***** Record a status byte in the history of an address *****/
+void stbRecord(uint8_t addr, uint8_t sb) {
+  stbHist *hist;
+  uint8_t idx;
+
+  if (addr > 30) return;
+  hist = &stbHistory[addr];
+
+  // Record only when the status byte changes
+  if (hist->cnt) {
+    idx = (hist->head + hist->cnt - 1) % SPOLL_HISTORY;
+    if (hist->sb[idx] == sb) return;
+  }
+
+  // Full - discard oldest entry
+  if (hist->cnt == SPOLL_HISTORY) {
+    hist->head = (hist->head + 1) % SPOLL_HISTORY;
+    hist->cnt--;
+  }
+
+  idx = (hist->head + hist->cnt) % SPOLL_HISTORY;
+  hist->tstamp[idx] = millis();
+  hist->sb[idx] = sb;
+  hist->cnt++;
+}
+#endif
+
+
+/***** End a serial poll *****/
+/*
+ * Send serial poll disable (SPD), untalk and unlisten
+ * the bus and return to controller idle state
+ */
+bool spollEnd() {
+
+  // Send Serial Poll Disable [SPD] to all devices
+  if ( gpibBus.sendCmd(GC_SPD) )  {
+#ifdef DEBUG_SPOLL
+    DB_PRINT(F("failed to send SPD"),"");
+#endif
+    return ERR;
+  }
+
+  // Send Untalk [UNT] to all devices
+  if ( gpibBus.sendCmd(GC_UNT) )  {
+#ifdef DEBUG_SPOLL
+    DB_PRINT(F("failed to send UNT"),"");
+#endif
+    return ERR;
+  }
+
+  // Unadress listners [UNL] to all devices
+  if ( gpibBus.sendCmd(GC_UNL) )  {
+#ifdef DEBUG_SPOLL
+    DB_PRINT(F("failed to send UNL"),"");
+#endif
+    return ERR;
+  }
+
+  // Set GPIB control to controller idle state
+  gpibBus.setControls(CIDS);
+
+  return OK;
+}
+
+
+/***** Identify the device requesting service *****/
+/*
+ * If any devices have been configured for parallel poll then a
+ * parallel poll is used to identify the requesting device(s) and
+ * only those are serial polled. If the requester has not been
+ * identified and pollAll is set, all addresses are polled in turn.
+ */
+bool srqFind(uint8_t *addr, uint8_t *sb, bool pollAll) {
+  uint8_t order[31];
+  uint8_t ocnt = 0;
+  uint8_t ppr = 0;
+  bool found = false;
+  bool ppConfigured = false;
+
+  // Any devices configured for parallel poll?
+  for (uint8_t i = 0; i < 31; i++) {
+    if (ppCfg[i]) {
+      ppConfigured = true;
+      break;
+    }
+  }
+
+  // Identify requester(s) with a single parallel poll
+  if (ppConfigured) ppr = gpibBus.parallelPoll();
+
+  if (!ppr && !pollAll) return false;
+
+  if (spollBegin()) return false;
+
+  // Poll devices whose DIO line responded to the parallel poll
+  if (ppr) {
+    for (uint8_t i = 0; i < 31; i++) {
+      if ( ppCfg[i] && (ppr & (1 << (ppCfg[i] & 0x07))) ) {
+        srqPolls++;
+        if (spollDevice(i, sb) == OK) {
+          if (*sb & 0x40) {
+            *addr = i;
+            found = true;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  // Not identified - poll all devices, most frequent requesters first
+  if (!found && pollAll) {
+    ocnt = spollOrder(order);
+    for (uint8_t i = 0; i < ocnt; i++) {
+      srqPolls++;
+      if (spollDevice(order[i], sb) == OK) {
+        if (*sb & 0x40) {
+          *addr = order[i];
+          found = true;
+          break;
+        }
+      }
+    }
+  }
+
+  spollEnd();
+
+  if (found) srqRecord(*addr);
+
+  return found;
+}
+
+
+/***** Build the serial poll order for all devices *****/
+/*
+ * Addresses are ordered by their service request history, most
+ * frequent requesters first, ties in address order. A device that has
+ * been serviced SPOLL_FAIR_LIMIT times in succession is moved to the
+ * end when SRQ was still asserted after its last service, so that
+ * other requesters cannot be starved. A device that is the only
+ * requester keeps its place. The controller
+ * address is excluded. Returns the number of addresses in order.
+ */
+uint8_t spollOrder(uint8_t order[31]) {
+  uint8_t cnt = 0;
+  uint8_t addr;
+  int8_t k;
+
+  for (addr = 0; addr < 31; addr++) {
+    if (addr == gpibBus.cfg.caddr) continue;
+    // Insertion sort by descending history (stable)
+    k = cnt - 1;
+    while ( (k >= 0) && (spollRank(order[k]) < spollRank(addr)) ) {
+      order[k + 1] = order[k];
+      k--;
+    }
+    order[k + 1] = addr;
+    cnt++;
+  }
+  return cnt;
+}
+
+
+/***** Rank of an address in the serial poll order *****/
+uint16_t spollRank(uint8_t addr) {
+  // Fairness bound reached while another device is waiting - poll last
+  if ( (addr == srqLastAddr) && (srqRun >= SPOLL_FAIR_LIMIT) && srqOthers ) return 0;
+  return (uint16_t)srqHits[addr] + 1;
+}
+
+
+/***** Record a serviced request in the history *****/
+void srqRecord(uint8_t addr) {
+  srqServiced++;
+
+  // The device has released SRQ after being polled, so SRQ still
+  // asserted means that another device is requesting service
+  srqOthers = gpibBus.isAsserted(SRQ_PIN);
+
+  // Consecutive services of the same device
+  if (addr == srqLastAddr) {
+    if (srqRun < 255) srqRun++;
+  } else {
+    srqLastAddr = addr;
+    srqRun = 1;
+  }
+
+  // Saturating count
+  if (srqHits[addr] < 255) srqHits[addr]++;
+
+  // Age the history so that the order adapts to change
+  srqDecayCnt++;
+  if ( (srqDecayCnt >= SPOLL_DECAY) || (srqHits[addr] == 255) ) {
+    for (uint8_t i = 0; i < 31; i++) {
+      srqHits[i] = srqHits[i] >> 1;
+    }
+    srqDecayCnt = 0;
+  }
+}
+
+
+/***** Show and reset serial poll statistics *****/
+/*
+ * Output: services,polls,polls per service (x100)
+ */
+void spollStats() {
+  dataPort.print(srqServiced);
+  dataPort.print(',');
+  dataPort.print(srqPolls);
+  dataPort.print(',');
+  dataPort.println(srqServiced ? (srqPolls * 100) / srqServiced : 0);
+  srqServiced = 0;
+  srqPolls = 0;
+}
+
+
+/***** Service a request when SRQ is asserted (srqauto) *****/
+/*
+ * srqauto 1: the requester is identified by parallel poll (when
+ * configured) and reported as SRQ:addr,status, otherwise the currently
+ * addressed device is serial polled.
+ * srqauto 2: the requester is identified and its status byte is placed
+ * into the event queue together with the time that SRQ was asserted.
+ * When no requester is found a SRQ_NOTFOUND event is queued and the
+ * search is not repeated for a back-off time that doubles with each
+ * failed search, as polling all addresses costs a read timeout for
+ * each absent device.
+ */
+void srqService() {
+  uint8_t addr = 0;
+  uint8_t sb = 0;
+
+#ifdef SRQ_QUEUE_SIZE
+  if (isSrqa == 2) {
+    unsigned long tstamp = micros();
+
+    // Backing off after a failed search (keep the captured time)
+    if ( srqBackoff && ((long)(millis() - srqRetry) < 0) ) return;
+
+    // Time captured by interrupt?
+    noInterrupts();
+    if (srqFlag) {
+      tstamp = srqTstamp;
+      srqFlag = false;
+    }
+    interrupts();
+
+    if (srqFind(&addr, &sb, true)) {
+      srqQueuePut(addr, sb, tstamp);
+      srqBackoff = 0;
+    }else{
+      srqQueuePut(SRQ_NOTFOUND, 0, tstamp);
+      srqBackoff = srqBackoff ? ((srqBackoff < (SRQ_BACKOFF_MAX / 2)) ? (srqBackoff * 2) : SRQ_BACKOFF_MAX) : SRQ_BACKOFF_MIN;
+      srqRetry = millis() + srqBackoff;
+    }
+    return;
+  }
+#endif
+
+  srqFlag = false;
+
+  if (srqFind(&addr, &sb, false)) {
+    dataPort.print(F("SRQ:")); dataPort.print(addr); dataPort.print(F(",")); dataPort.println(sb, DEC);
+    return;
+  }
+
+  // Requester not identified - poll addressed device
+  spoll_h(NULL);
+}
+
+
+/***** SRQ interrupt handler *****/
+void srqIsr() {
+  // Record the time of the first assertion until serviced
+  if (!srqFlag) {
+    srqTstamp = micros();
+    srqFlag = true;
+  }
+}
+
+
+#ifdef SRQ_QUEUE_SIZE
+/***** Add a service request event to the queue *****/
+void srqQueuePut(uint8_t addr, uint8_t sb, unsigned long tstamp) {
+  uint8_t idx;
+  if (srqqCnt == SRQ_QUEUE_SIZE) {
+    // Queue full - discard oldest event
+    srqqHead = (srqqHead + 1) % SRQ_QUEUE_SIZE;
+    srqqCnt--;
+    srqqLost++;
+  }
+  idx = (srqqHead + srqqCnt) % SRQ_QUEUE_SIZE;
+  srqQueue[idx].tstamp = tstamp;
+  srqQueue[idx].addr = addr;
+  srqQueue[idx].sb = sb;
+  srqqCnt++;
+}
+#endif
+
+
+/***** Return status of SRQ line *****/
+void srq_h() {
+  //NOTE: LOW=asserted=true=1, HIGH=unasserted=false=0
+  dataPort.println(gpibBus.isAsserted(SRQ_PIN));
+}
+
+
+/***** Set the status byte (device mode) *****/
+void stat_h(char *params) {
+  uint16_t statusByte = 0;
   // A parameter given?
   if (params != NULL) {
     // Byte value given?
     if (notInRange(params, 0, 255, statusByte)) return;
+#ifdef MULTI_ADDR
+    if (devSel) {
+      devSlots[devSel-1].stat = (uint8_t)statusByte;
+      devSrqUpdate();
+      return;
+    }
+#endif
     gpibBus.setStatus((uint8_t)statusByte);
+#ifdef MULTI_ADDR
+    devSrqUpdate();
+#endif
   } else {
     // Return the currently set status byte
+#ifdef MULTI_ADDR
+    if (devSel) {
+      dataPort.println(devSlots[devSel-1].stat);
+      return;
+    }
+#endif
     dataPort.println(gpibBus.cfg.stat);
   }
 }
@@ -1797,7 +2778,27 @@ void save_h() {
 void lon_h(char *params) {
   uint16_t lval;
   if (params != NULL) {
+#ifdef LON_BUFFER
+    char *param = strtok(params, " \t");
+    uint16_t idle = lonIdle;
+    if (notInRange(param, 0, 2, lval)) return;
+    if (lval == 2) {
+      // Idle time that ends a capture
+      param = strtok(NULL, " \t");
+      if (param != NULL) {
+        if (notInRange(param, 10, 60000, idle)) return;
+      }
+    }
+    if (isLonBuf && isRO && (lval != 2)) {
+      // Leaving buffered mode: send what is left in the buffer and report
+      isRO = false;
+      lonBufMode();
+    }
+    isLonBuf = (lval == 2);
+    lonIdle = idle;
+#else
     if (notInRange(params, 0, 1, lval)) return;
+#endif
     isRO = lval ? true : false;
     if (isRO) {
       isTO = 0;       // Talk-only mode must be disabled!
@@ -1808,6 +2809,12 @@ void lon_h(char *params) {
       dataPort.println(lval ? "ON" : "OFF") ;
     }
   } else {
+#ifdef LON_BUFFER
+    if (isLonBuf && isRO) {
+      dataPort.println(2);
+      return;
+    }
+#endif
     dataPort.println(isRO);
   }
 }
@@ -1914,29 +2921,120 @@ void ppoll_h() {
   uint8_t sb = 0;
 
   // Poll devices
-  // Start in controller idle state
-  gpibBus.setControls(CIDS);
-  delayMicroseconds(20);
+  sb = gpibBus.parallelPoll();
+
+  // Output the response byte
+  dataPort.println(sb, DEC);
+
+  if (isVerb) dataPort.println(F("Parallel poll completed."));
+}
+
+
+/***** Configure the parallel poll response of a device *****/
+/*
+ * Usage: ++ppe addr line [sense]
+ * line: DIO line (1-8) on which the device responds
+ * sense: level of the device ist message on which it responds (default 1)
+ * Without parameters lists the configured devices as: addr line sense
+ */
+void ppe_h(char *params) {
+  char *param;
+  uint16_t addr = 0;
+  uint16_t line = 0;
+  uint16_t sense = 1;
+  uint8_t ppe = 0;
+
+  // List configuration
+  if (params == NULL) {
+    for (uint8_t i = 0; i < 31; i++) {
+      if (ppCfg[i]) {
+        dataPort.print(i);
+        dataPort.print(' ');
+        dataPort.print((ppCfg[i] & 0x07) + 1);
+        dataPort.print(' ');
+        dataPort.println((ppCfg[i] & 0x08) ? 1 : 0);
+      }
+    }
+    return;
+  }
+
+  // Address
+  param = strtok(params, " ,\t");
+  if (notInRange(param, 0, 30, addr)) return;
+  if (addr == gpibBus.cfg.caddr) {
+    errorMsg(2);
+    if (isVerb) dataPort.println(F("Cannot configure the controller!"));
+    return;
+  }
+
+  // DIO line
+  param = strtok(NULL, " ,\t");
+  if (param == NULL) {
+    errorMsg(1);
+    return;
+  }
+  if (notInRange(param, 1, 8, line)) return;
 
-  // Assert ATN and EOI
-  gpibBus.setTransmitMode(TM_SEND);
-  gpibBus.assertSignal( ATN_BIT | EOI_BIT );
-  gpibBus.setTransmitMode(TM_RECV);
-  delayMicroseconds(20);
+  // Sense (optional)
+  param = strtok(NULL, " ,\t");
+  if (param != NULL) {
+    if (notInRange(param, 0, 1, sense)) return;
+  }
 
-  // Read data byte from GPIB bus without handshake
-  sb = readGpibDbus();
+  ppe = GC_PPE | (sense << 3) | (line - 1);
 
-  // Return to controller idle state (ATN and EOI unasserted)
+  if (gpibBus.sendPPE(addr, ppe)) {
+    errorMsg(3);
+    gpibBus.setControls(CIDS);
+    return;
+  }
   gpibBus.setControls(CIDS);
+  ppCfg[addr] = ppe;
 
-  // Output the response byte
-  dataPort.println(sb, DEC);
+  if (isVerb) {
+    dataPort.print(F("Device "));
+    dataPort.print(addr);
+    dataPort.print(F(" responds to parallel poll on DIO"));
+    dataPort.println(line);
+  }
+}
 
-  if (isVerb) dataPort.println(F("Parallel poll completed."));
+
+/***** Disable the parallel poll response of a device *****/
+void ppd_h(char *params) {
+  uint16_t addr = 0;
+
+  if (params == NULL) {
+    errorMsg(1);
+    return;
+  }
+  if (notInRange(params, 0, 30, addr)) return;
+
+  if (gpibBus.sendPPD(addr)) {
+    errorMsg(3);
+    gpibBus.setControls(CIDS);
+    return;
+  }
+  gpibBus.setControls(CIDS);
+  ppCfg[addr] = 0;
+
+  if (isVerb) dataPort.println(F("Parallel poll response disabled."));
 }
 
 
+/***** Unconfigure the parallel poll response of all devices *****/
+void ppu_h() {
+  if (gpibBus.sendPPU()) {
+    errorMsg(3);
+    gpibBus.setControls(CIDS);
+    return;
+  }
+  gpibBus.setControls(CIDS);
+  memset(ppCfg, 0, sizeof(ppCfg));
+
+  if (isVerb) dataPort.println(F("Parallel poll unconfigured."));
+}
+
 /***** Assert or de-assert REN 0=de-assert; 1=assert *****/
 void ren_h(char *params) {
 #if defined (SN7516X) && not defined (SN7516X_DC)
@@ -2003,7 +3101,22 @@ void setvstr_h(char *params) {
 void prom_h(char *params) {
   uint16_t pval;
   if (params != NULL) {
+#ifdef PROM_CAPTURE
+    if (strncasecmp(params, "dump", 4) == 0) {
+      promDump();
+      return;
+    }
+    if (strncasecmp(params, "clear", 5) == 0) {
+      promHead = 0;
+      promCnt = 0;
+      promLost = 0;
+      return;
+    }
+    if (notInRange(params, 0, 2, pval)) return;
+    promCap = (pval == 2);
+#else
     if (notInRange(params, 0, 1, pval)) return;
+#endif
     isProm = pval ? true : false;
     if (isProm) {
       isTO = 0;     // Talk-only mode must be disabled!
@@ -2014,69 +3127,499 @@ void prom_h(char *params) {
       dataPort.println(pval ? "ON" : "OFF") ;
     }
   } else {
+#ifdef PROM_CAPTURE
+    if (promCap) {
+      dataPort.println(2);
+      return;
+    }
+#endif
     dataPort.println(isProm);
   }
 }
 
 
+#ifdef PROM_CAPTURE
+/***** Add a byte seen on the bus to the capture buffer *****/
+/*
+ * When the buffer is full the oldest record is overwritten
+ */
+void promRecord(uint8_t db, uint8_t flags) {
+  uint16_t idx;
+  bool keep;
+  // Triggered window complete - wait until it has been sent
+  if (ptrigDone) return;
+  keep = promFilter(db, flags);
+  if (keep) {
+    if (promCnt == PROM_CAPTURE) {
+      promHead = (promHead + 1) % PROM_CAPTURE;
+      promCnt--;
+      promLost++;
+    }
+    idx = (promHead + promCnt) % PROM_CAPTURE;
+    promBuf[idx].tstamp = micros();
+    promBuf[idx].db = db;
+    promBuf[idx].flags = flags;
+    promCnt++;
+  }
+  // Bytes that are filtered out can still fire the trigger
+  if (ptrigType) promTrigger(db, flags, keep);
+}
 
-/***** Talk only mode *****/
-void ton_h(char *params) {
-  uint16_t toval;
-  if (params != NULL) {
-    if (notInRange(params, 0, 2, toval)) return;
-    isTO = (uint8_t)toval;
-    if (isTO>0) {
-      isRO = false;   // Read-only mode must be disabled in TO mode!
-      isProm = false; // Promiscuous mode must be disabled in TO mode!
+
+/***** Check the capture filter *****/
+/*
+ * The talker is followed from the commands on the bus so that the data
+ * of one device can be selected.
+ */
+bool promFilter(uint8_t db, uint8_t flags) {
+  if (flags & PROM_ATN) {
+    db &= 0x7F;
+    if (db == GC_UNT) {
+      promTalker = 0xFF;
+    }else if ((db & 0x60) == 0x40) {
+      promTalker = db & 0x1F;
     }
-  }else{
-    if (isVerb) {
-      dataPort.print(F("TON: "));
-      switch (isTO) {
-        case 1:
-          dataPort.println(F("ON unbuffered"));
-          break;
-        case 2:
-          dataPort.println(F("ON buffered"));
-          break;
-        default:
-          dataPort.println(F("OFF"));
+  }
+  switch (pfiltType) {
+    case PFILT_ATN:
+      return (flags & PROM_ATN);
+    case PFILT_DATA:
+      return !(flags & PROM_ATN);
+    case PFILT_TALKER:
+      return !(flags & PROM_ATN) && (promTalker == pfiltVal);
+  }
+  return true;
+}
+
+
+/***** Check the capture trigger *****/
+bool promTrigMatch(uint8_t db, uint8_t flags) {
+  switch (ptrigType) {
+    case PTRIG_TAD:
+      return (flags & PROM_ATN) && (db == (ptrigVal + 0x40));
+    case PTRIG_LAD:
+      return (flags & PROM_ATN) && (db == (ptrigVal + 0x20));
+    case PTRIG_CMD:
+      return (flags & PROM_ATN) && (db == ptrigVal);
+    case PTRIG_DATA:
+      if (flags & PROM_ATN) return false;
+      // Fall back to the longest part still matched (overlapping patterns)
+      while (ptrigPos && (db != (uint8_t)ptrigPat[ptrigPos])) ptrigPos = ptrigFail[ptrigPos];
+      if (db == (uint8_t)ptrigPat[ptrigPos]) ptrigPos++;
+      if (ptrigPat[ptrigPos] == '\0') {
+        ptrigPos = ptrigFail[ptrigPos];
+        return true;
       }
-    }
-    dataPort.println(isTO);
+      return false;
+    case PTRIG_SRQ:
+      return gpibBus.isAsserted(SRQ_PIN);
   }
+  return false;
 }
 
 
-/***** SRQ auto - show or enable/disable automatic spoll on SRQ *****/
+/***** Build the fallback table for the data pattern (KMP) *****/
 /*
- * When SRQ auto is set to 1 and a decivce triggers thw SRQ
+ * ptrigFail[n] is the length of the longest proper prefix of the pattern
+ * that ends the first n characters.
+ */
+void ptrigBuildFail() {
+  uint8_t k = 0;
+  ptrigFail[0] = 0;
+  ptrigFail[1] = 0;
+  for (uint8_t q = 1; ptrigPat[q] != '\0'; q++) {
+    while (k && (ptrigPat[q] != ptrigPat[k])) k = ptrigFail[k];
+    if (ptrigPat[q] == ptrigPat[k]) k++;
+    ptrigFail[q + 1] = k;
+  }
+}
+
+
+/***** Track the trigger window *****/
+/*
+ * On trigger, records older than the pre-trigger depth are discarded.
+ * The window is complete when the post-trigger records have been
+ * captured and is then sent with promDump(). Only captured records
+ * (kept by the filter) count towards the window.
+ */
+void promTrigger(uint8_t db, uint8_t flags, bool kept) {
+  if (ptrigFired) {
+    if (kept && ptrigPostCnt) ptrigPostCnt--;
+  }else{
+    if (!promTrigMatch(db, flags)) return;
+    // Keep pre-trigger records and the trigger record
+    while (promCnt > (ptrigPre + (kept ? 1 : 0))) {
+      promHead = (promHead + 1) % PROM_CAPTURE;
+      promCnt--;
+    }
+    promLost = 0;
+    ptrigFired = true;
+    ptrigPostCnt = ptrigPost;
+  }
+  if (!ptrigPostCnt) ptrigDone = true;
+}
+
+
+/***** Capture data bytes until ATN is asserted *****/
+void promListen() {
+  uint8_t db;
+  bool eoi;
+  while (!gpibBus.isAsserted(ATN_PIN)) {
+    if (gpibBus.readByte(&db, true, &eoi) != HANDSHAKE_COMPLETE) break;
+    promRecord(db, eoi ? PROM_EOI : 0);
+  }
+}
+
+
+/***** Write a 32 bit value to the host (little endian) *****/
+void promWriteLE(uint32_t val, uint8_t bytes) {
+  for (uint8_t i = 0; i < bytes; i++) {
+    dataPort.write((uint8_t)(val & 0xFF));
+    val >>= 8;
+  }
+}
+
+
+/***** Send the capture buffer to the host and clear it *****/
+/*
+ * Binary format (little endian):
+ * header: "ARPC", version (1 byte), record count (2 bytes), records lost (2 bytes)
+ * record: time in microseconds (4 bytes), data byte, flags (bit 0=ATN, bit 1=EOI)
+ * See src/tools/ar488_promdecode.py
+ */
+void promDump() {
+  uint16_t idx;
+  uint16_t cnt = promCnt;
+  dataPort.print(F("ARPC"));
+  dataPort.write((uint8_t)1);
+  promWriteLE(cnt, 2);
+  promWriteLE(promLost, 2);
+  for (uint16_t i = 0; i < cnt; i++) {
+    idx = (promHead + i) % PROM_CAPTURE;
+    promWriteLE(promBuf[idx].tstamp, 4);
+    dataPort.write(promBuf[idx].db);
+    dataPort.write(promBuf[idx].flags);
+  }
+  promHead = 0;
+  promCnt = 0;
+  promLost = 0;
+  // Re-arm trigger
+  ptrigFired = false;
+  ptrigDone = false;
+  ptrigPos = 0;
+}
+#endif
+
+
+/***** Set the promiscuous mode capture trigger *****/
+/*
+ * Usage: ++ptrig [tad n | lad n | cmd n | data str | srq | off | pre n | post n]
+ *        ++ptrig filter [off | atn | data | talker n]
+ * When a trigger is set, each time it matches the pre-trigger records,
+ * the trigger record and the post-trigger records are sent to the host
+ * in the ++prom dump format and the trigger is re-armed. The filter
+ * limits the capture (with or without a trigger) to commands, data, or
+ * the data sent by one talker. Without parameters, returns the trigger
+ * type,value,pre,post,filter type,filter value.
+ */
+void ptrig_h(char *params) {
+#ifdef PROM_CAPTURE
+  char *param;
+  uint16_t val;
+  uint8_t type = PTRIG_OFF;
+
+  if (params == NULL) {
+    dataPort.print(ptrigType);
+    dataPort.print(',');
+    if (ptrigType == PTRIG_DATA) {
+      dataPort.print(ptrigPat);
+    }else{
+      dataPort.print(ptrigVal);
+    }
+    dataPort.print(',');
+    dataPort.print(ptrigPre);
+    dataPort.print(',');
+    dataPort.print(ptrigPost);
+    dataPort.print(',');
+    dataPort.print(pfiltType);
+    dataPort.print(',');
+    dataPort.println(pfiltVal);
+    return;
+  }
+
+  param = strtok(params, " \t");
+
+  if (strncasecmp(param, "filter", 6) == 0) {
+    param = strtok(NULL, " \t");
+    if (param == NULL) {
+      errorMsg(1);
+      return;
+    }
+    if (strncasecmp(param, "off", 3) == 0) {
+      pfiltType = PFILT_OFF;
+    }else if (strncasecmp(param, "atn", 3) == 0) {
+      pfiltType = PFILT_ATN;
+    }else if (strncasecmp(param, "data", 4) == 0) {
+      pfiltType = PFILT_DATA;
+    }else if (strncasecmp(param, "talker", 6) == 0) {
+      param = strtok(NULL, " \t");
+      if (param == NULL) {
+        errorMsg(1);
+        return;
+      }
+      if (notInRange(param, 0, 30, val)) return;
+      pfiltVal = val;
+      pfiltType = PFILT_TALKER;
+    }else{
+      errorMsg(2);
+    }
+    return;
+  }
+
+  if (strncasecmp(param, "pre", 3) == 0 || strncasecmp(param, "post", 4) == 0) {
+    bool pre = (param[1] == 'r' || param[1] == 'R');
+    param = strtok(NULL, " \t");
+    if (param == NULL) {
+      errorMsg(1);
+      return;
+    }
+    // Window must fit in the capture buffer
+    if (notInRange(param, 0, PROM_CAPTURE - 1 - (pre ? ptrigPost : ptrigPre), val)) return;
+    if (pre) {
+      ptrigPre = val;
+    }else{
+      ptrigPost = val;
+    }
+    return;
+  }
+
+  if (strncasecmp(param, "off", 3) == 0) {
+    type = PTRIG_OFF;
+  }else if (strncasecmp(param, "srq", 3) == 0) {
+    type = PTRIG_SRQ;
+  }else if (strncasecmp(param, "data", 4) == 0) {
+    param = strtok(NULL, "");
+    // An empty pattern would match every data byte
+    if ((param == NULL) || (strlen(param) == 0)) {
+      errorMsg(1);
+      return;
+    }
+    if (strlen(param) > PTRIG_PATLEN) {
+      errorMsg(2);
+      return;
+    }
+    strcpy(ptrigPat, param);
+    ptrigBuildFail();
+    type = PTRIG_DATA;
+  }else{
+    if (strncasecmp(param, "tad", 3) == 0) {
+      type = PTRIG_TAD;
+    }else if (strncasecmp(param, "lad", 3) == 0) {
+      type = PTRIG_LAD;
+    }else if (strncasecmp(param, "cmd", 3) == 0) {
+      type = PTRIG_CMD;
+    }else{
+      errorMsg(2);
+      return;
+    }
+    param = strtok(NULL, " \t");
+    if (param == NULL) {
+      errorMsg(1);
+      return;
+    }
+    if (notInRange(param, 0, (type == PTRIG_CMD) ? 255 : 30, val)) return;
+    ptrigVal = val;
+  }
+
+  // Start with an empty buffer
+  ptrigType = type;
+  promHead = 0;
+  promCnt = 0;
+  promLost = 0;
+  ptrigFired = false;
+  ptrigDone = false;
+  ptrigPos = 0;
+#else
+  params = params;
+  dataPort.println(F("Disabled"));
+#endif
+}
+
+
+
+/***** Talk only mode *****/
+void ton_h(char *params) {
+  uint16_t toval;
+  if (params != NULL) {
+#ifdef TON_BUFFER
+    char *param;
+    uint16_t eom;
+    if (strncasecmp(params, "stats", 5) == 0) {
+      tonStats();
+      return;
+    }
+    param = strtok(params, " \t");
+    if (notInRange(param, 0, 3, toval)) return;
+    if (toval == 3) {
+      // End of message character
+      param = strtok(NULL, " \t");
+      if (param != NULL) {
+        if (notInRange(param, 0, 255, eom)) return;
+        ton.eom = eom;
+      }else{
+        ton.eom = -1;
+      }
+      if (isTO != 3) {
+        ton.head = 0;
+        ton.tail = 0;
+        ton.cnt = 0;
+        ton.bol = true;
+        ton.bytes = 0;
+        ton.errors = 0;
+        ton.stalls = 0;
+        ton.lost = 0;
+      }
+    }
+#else
+    if (notInRange(params, 0, 2, toval)) return;
+#endif
+    isTO = (uint8_t)toval;
+    if (isTO>0) {
+      isRO = false;   // Read-only mode must be disabled in TO mode!
+      isProm = false; // Promiscuous mode must be disabled in TO mode!
+    }
+  }else{
+    if (isVerb) {
+      dataPort.print(F("TON: "));
+      switch (isTO) {
+        case 1:
+          dataPort.println(F("ON unbuffered"));
+          break;
+        case 2:
+          dataPort.println(F("ON buffered"));
+          break;
+        case 3:
+          dataPort.println(F("ON burst"));
+          break;
+        default:
+          dataPort.println(F("OFF"));
+      }
+    }
+    dataPort.println(isTO);
+  }
+}
+
+
+/***** SRQ auto - show or enable/disable automatic spoll on SRQ *****/
+/*
+ * When SRQ auto is set to 1 and a decivce triggers thw SRQ
  * signal, a serial poll is conducted automatically and
  * the status byte for the instrument requiring service gets
  * returned automatically. When srqauto is set to 0 (default)
  * an ++spoll command needs to be given manually to return
- * the status byte.
+ * the status byte. When srqauto is set to 2 the status byte
+ * and address of the requesting device are queued with the
+ * time that SRQ was asserted and can be read with ++srqq.
  */
 void srqa_h(char *params) {
   uint16_t val;
   if (params != NULL) {
+#ifdef SRQ_QUEUE_SIZE
+    if (notInRange(params, 0, 2, val)) return;
+    srqBackoff = 0;
+#else
     if (notInRange(params, 0, 1, val)) return;
-    switch (val) {
-      case 0:
-        isSrqa = false;
-        break;
-      case 1:
-        isSrqa = true;
-        break;
+#endif
+    isSrqa = (uint8_t)val;
+    srqFlag = false;
+    if (isVerb) {
+      switch (isSrqa) {
+        case 1:
+          dataPort.println(F("SRQ auto ON"));
+          break;
+        case 2:
+          dataPort.println(F("SRQ auto ON (queued)"));
+          break;
+        default:
+          dataPort.println(F("SRQ auto OFF"));
+      }
     }
-    if (isVerb) dataPort.println(isSrqa ? "SRQ auto ON" : "SRQ auto OFF") ;
   } else {
     dataPort.println(isSrqa);
   }
 }
 
 
+/***** Read and clear the service request event queue *****/
+/*
+ * Returns one line per event: addr,status,time(us)
+ * followed by LOST:n if events were discarded, and a blank line.
+ * addr is -1 when SRQ was asserted but no requester was found.
+ */
+void srqq_h() {
+#ifdef SRQ_QUEUE_SIZE
+  uint8_t idx;
+  while (srqqCnt) {
+    idx = srqqHead;
+    if (srqQueue[idx].addr == SRQ_NOTFOUND) {
+      dataPort.print(F("-1"));
+    }else{
+      dataPort.print(srqQueue[idx].addr);
+    }
+    dataPort.print(',');
+    dataPort.print(srqQueue[idx].sb);
+    dataPort.print(',');
+    dataPort.println(srqQueue[idx].tstamp);
+    srqqHead = (srqqHead + 1) % SRQ_QUEUE_SIZE;
+    srqqCnt--;
+  }
+  if (srqqLost) {
+    dataPort.print(F("LOST:"));
+    dataPort.println(srqqLost);
+    srqqLost = 0;
+  }
+  dataPort.println();
+#else
+  dataPort.println(F("Disabled"));
+#endif
+}
+
+/***** Show the status byte history of a device *****/
+/*
+ * Usage: ++sthist [addr|clear]
+ * Returns one line per status byte change, oldest first: time(ms),status
+ * followed by a blank line. Without an address the currently
+ * addressed device is shown.
+ */
+void sthist_h(char *params) {
+#ifdef SPOLL_HISTORY
+  uint16_t addr = gpibBus.cfg.paddr;
+  stbHist *hist;
+  uint8_t idx;
+
+  if (params != NULL) {
+    if (strncasecmp(params, "clear", 5) == 0) {
+      memset(stbHistory, 0, sizeof(stbHistory));
+      if (isVerb) dataPort.println(F("Status byte history cleared."));
+      return;
+    }
+    if (notInRange(params, 0, 30, addr)) return;
+  }
+
+  hist = &stbHistory[addr];
+  for (uint8_t i = 0; i < hist->cnt; i++) {
+    idx = (hist->head + i) % SPOLL_HISTORY;
+    dataPort.print(hist->tstamp[idx]);
+    dataPort.print(',');
+    dataPort.println(hist->sb[idx]);
+  }
+  dataPort.println();
+#else
+  params = params;
+  dataPort.println(F("Disabled"));
+#endif
+}
+
 /***** Repeat a given command and return result *****/
 void repeat_h(char *params) {
 
@@ -2088,7 +3631,7 @@ void repeat_h(char *params) {
     // Count (number of repetitions)
     param = strtok(params, " \t");
     if (strlen(param) > 0) {
-      if (notInRange(param, 2, 255, count)) return;
+      if (notInRange(param, 2, 65535, count)) return;
     }
     // Time delay (milliseconds)
     param = strtok(NULL, " \t");
@@ -2099,11 +3642,15 @@ void repeat_h(char *params) {
     // Pointer to remainder of parameters string
     param = strtok(NULL, "\n\r");
     if (strlen(param) > 0) {
+      if (reduceMode != REDUCE_OFF) {
+        repeatReduced(param, count, tmdly);
+        return;
+      }
       for (uint16_t i = 0; i < count; i++) {
         // Send string to instrument
         gpibBus.sendData(param, strlen(param));
         delay(tmdly);
-        gpibBus.receiveData(dataPort, gpibBus.cfg.eoi, false, 0);
+        readToHost(gpibBus.cfg.eoi, false, 0);
       }
     } else {
       errorMsg(2);
@@ -2118,6 +3665,160 @@ void repeat_h(char *params) {
 }
 
 
+/***** Reduce repeated readings *****/
+/*
+ * Usage: ++reduce 0 | stats n | every n
+ * stats: repeat returns count,mean,min,max,stddev of each n readings
+ * (and of any remainder) instead of the readings themselves. Responses
+ * that are not numbers are left out of the count.
+ * every: repeat returns only every nth reading.
+ */
+void reduce_h(char *params) {
+  char *param;
+  uint8_t mode;
+
+  if (params == NULL) {
+    dataPort.print(reduceMode);
+    if (reduceMode != REDUCE_OFF) {
+      dataPort.print(' ');
+      dataPort.print(reduceCnt);
+    }
+    dataPort.println();
+    return;
+  }
+
+  param = strtok(params, " \t");
+  if (strcmp(param, "0") == 0) {
+    reduceMode = REDUCE_OFF;
+    return;
+  }
+  if (strncasecmp(param, "stats", 5) == 0) {
+    mode = REDUCE_STATS;
+  } else if (strncasecmp(param, "every", 5) == 0) {
+    mode = REDUCE_EVERY;
+  } else {
+    errorMsg(2);
+    return;
+  }
+  param = strtok(NULL, " \t");
+  if (param == NULL) {
+    errorMsg(1);
+    return;
+  }
+  if (notInRange(param, 1, 65535, reduceCnt)) return;
+  reduceMode = mode;
+}
+
+
+/***** Print a value in scientific notation (d.ddddddE+xx) *****/
+void printSci(Stream &out, double val) {
+  int16_t exp = 0;
+
+  if (isnan(val) || isinf(val)) {
+    out.print(F("NAN"));
+    return;
+  }
+  if (val < 0) {
+    out.print('-');
+    val = -val;
+  }
+  if (val > 0) {
+    while (val >= 10.0) { val /= 10.0; exp++; }
+    while (val < 1.0) { val *= 10.0; exp--; }
+    // Rounding to 6 decimals must not print 10.000000
+    if (val >= 9.9999995) { val /= 10.0; exp++; }
+  }
+  out.print(val, 6);
+  out.print('E');
+  if (exp >= 0) out.print('+');
+  out.print(exp);
+}
+
+
+/***** Send the statistics of a group of readings to the host *****/
+void reduceReport(uint16_t n, double mean, double m2, double vmin, double vmax) {
+  Stream &out = isBinOut ? (Stream&)numPort : (Stream&)dataPort;
+
+  out.print(n);
+  out.print(',');
+  if (n == 0) {
+    out.print(F("NAN,NAN,NAN,NAN"));
+  } else {
+    printSci(out, mean);
+    out.print(',');
+    printSci(out, vmin);
+    out.print(',');
+    printSci(out, vmax);
+    out.print(',');
+    printSci(out, (n > 1) ? sqrt(m2 / (n - 1)) : 0.0);
+  }
+  if (isBinOut) {
+    numPort.endResponse();
+  } else {
+    dataPort.println();
+  }
+}
+
+
+/***** Repeat a command and reduce the readings (see reduce_h) *****/
+void repeatReduced(char *cmd, uint16_t count, uint16_t tmdly) {
+  char rbuf[48];
+  BUFSTREAM resp(rbuf, sizeof(rbuf));
+  char *rp;
+  char *endp;
+  double val;
+  double delta;
+  double mean = 0.0;
+  double m2 = 0.0;
+  double vmin = 0.0;
+  double vmax = 0.0;
+  uint16_t n = 0;
+  uint16_t cnt = 0;
+
+  for (uint16_t i = 0; i < count; i++) {
+    gpibBus.sendData(cmd, strlen(cmd));
+    delay(tmdly);
+
+    if (reduceMode == REDUCE_EVERY) {
+      // Pass on every nth reading, read the others into the buffer and discard
+      if ((i % reduceCnt) == (reduceCnt - 1)) {
+        readToHost(gpibBus.cfg.eoi, false, 0);
+      } else {
+        resp.clear();
+        gpibBus.receiveData(resp, gpibBus.cfg.eoi, false, 0);
+      }
+      continue;
+    }
+
+    resp.clear();
+    gpibBus.receiveData(resp, gpibBus.cfg.eoi, false, 0);
+    cnt++;
+
+    // Skip any prefix (e.g. function header) in front of the number
+    rp = rbuf;
+    while (*rp && !isdigit(*rp) && (*rp != '+') && (*rp != '-') && (*rp != '.')) rp++;
+    val = strtod(rp, &endp);
+    if (endp != rp) {
+      // Running mean and sum of squared deviations (Welford)
+      n++;
+      delta = val - mean;
+      mean += delta / n;
+      m2 += delta * (val - mean);
+      if ((n == 1) || (val < vmin)) vmin = val;
+      if ((n == 1) || (val > vmax)) vmax = val;
+    }
+
+    if ((cnt == reduceCnt) || (i == (count - 1))) {
+      reduceReport(n, mean, m2, vmin, vmax);
+      n = 0;
+      cnt = 0;
+      mean = 0.0;
+      m2 = 0.0;
+    }
+  }
+}
+
+
 /***** Take Control command *****/
 void tct_h(char *params){
   uint16_t val;
@@ -2156,6 +3857,40 @@ void macro_h(char *params) {
   const char * macro;
 
   if (params != NULL) {
+#ifdef MACRO_EEPROM
+    // Define, delete or list a stored macro
+    if ( (strncasecmp(params, "def", 3) == 0) || (strncasecmp(params, "del", 3) == 0) || (strncasecmp(params, "list", 4) == 0) ) {
+      char *param = strtok(params, " \t");
+      char *numstr = strtok(NULL, " \t");
+      if (numstr == NULL) {
+        errorMsg(1);
+        return;
+      }
+      if (notInRange(numstr, 0, 9, val)) return;
+      if (strncasecmp(param, "list", 4) == 0) {
+        macroList((uint8_t)val);
+        dataPort.println();
+        return;
+      }
+      macroStoreInit();
+      macroDelete((uint8_t)val);
+      if (strncasecmp(param, "def", 3) == 0) {
+        // Start recording (new record replaces the end marker)
+        macroRecAddr = macroFind(MACRO_END);
+        if ( !macroRecAddr || ((macroRecAddr + 4) > (EE_MACROS + MACRO_STORE)) ) {
+          dataPort.println(F("Macro storage full!"));
+          return;
+        }
+        epWriteByte(macroRecAddr + 1, 0);
+        epWriteByte(macroRecAddr + 2, 0);
+        epWriteByte(macroRecAddr + 3, MACRO_END);
+        epWriteByte(macroRecAddr, (uint8_t)val);
+        macroRec = (uint8_t)val;
+        if (isVerb) dataPort.println(F("Recording. End with ++macro end"));
+      }
+      return;
+    }
+#endif
     if (notInRange(params, 0, 9, val)) return;
     //    execMacro((uint8_t)val);
     runMacro = (uint8_t)val;
@@ -2163,7 +3898,11 @@ void macro_h(char *params) {
     for (int i = 0; i < 10; i++) {
       macro = (pgm_read_word(macros + i));
       //      dataPort.print(i);dataPort.print(F(": "));
+#ifdef MACRO_EEPROM
+      if ( (strlen_P(macro) > 0) || macroFind(i) ) {
+#else
       if (strlen_P(macro) > 0) {
+#endif
         dataPort.print(i);
         dataPort.print(" ");
       }
@@ -2177,27 +3916,139 @@ void macro_h(char *params) {
 }
 
 
-/***** Bus diagnostics *****/
+/***** Sequence loop *****/
 /*
- * Usage: xdiag mode byte
- * mode: pins=sho state of all pins; 0=data bus; 1=control bus
- * byte: byte to write on the bus
- * Note: values to switch individual bits = 1,2,4,8,10,20,40,80
- * States revert to controller or device mode after 10 seconds
- * Databus reverts to 0 (all HIGH) after 10 seconds
+ * Usage: ++loop count [start [step]] ... ++endloop
+ * Only has an effect within a macro defined with ++macro def, where
+ * it is handled by execStoredMacro(). Loops can be nested.
  */
-void xdiag_h(char *params){
-  char *param;
-  uint8_t mode = 0;
-  uint8_t byteval = 0;
-  
-  // Get first parameter (mode = 0 or 1)
-  param = strtok(params, " ,\t");
+void loop_h(char *params) {
+  params = params;
+  dataPort.println(F("Only valid in a stored macro"));
+}
 
-  if ( strncasecmp(param, "pins", 4) ==0) {
-    printDbPinout();
-    printCtrlPinout();
-    return;
+
+void endloop_h(char *params) {
+  params = params;
+  dataPort.println(F("Only valid in a stored macro"));
+}
+
+
+/***** Wait for SRQ or a status byte *****/
+/*
+ * Usage: ++wait srq [tmo_ms] | ++wait stb mask [value] [tmo_ms]
+ * srq waits for SRQ to be asserted. stb serial polls the addressed
+ * device until (status & mask) == value (value defaults to mask).
+ * With no timeout (or 0), waits until input is received from the host.
+ * On timeout a running stored macro is stopped.
+ */
+void wait_h(char *params) {
+  char *param;
+  uint16_t mask = 0;
+  uint16_t value = 0;
+  uint16_t tmo = 0;
+  uint16_t val;
+  uint8_t sb = 0;
+  bool isSrq;
+  unsigned long start = millis();
+
+  if (params == NULL) {
+    errorMsg(1);
+    return;
+  }
+
+  param = strtok(params, " ,\t");
+  isSrq = (strncasecmp(param, "srq", 3) == 0);
+  if (!isSrq) {
+    if (strncasecmp(param, "stb", 3) != 0) {
+      errorMsg(2);
+      return;
+    }
+    param = strtok(NULL, " ,\t");
+    if (param == NULL) {
+      errorMsg(1);
+      return;
+    }
+    if (notInRange(param, 0, 255, mask)) return;
+    value = mask;
+    param = strtok(NULL, " ,\t");
+    if (param != NULL) {
+      if (notInRange(param, 0, 255, value)) return;
+    }
+  }
+  param = strtok(NULL, " ,\t");
+  if (param != NULL) {
+    if (notInRange(param, 0, 65535, val)) return;
+    tmo = val;
+  }
+
+  while (true) {
+    if (isSrq) {
+      if (gpibBus.isAsserted(SRQ_PIN)) return;
+    }else{
+      if ( !spollBegin() && !spollDevice(gpibBus.cfg.paddr, &sb) ) {
+        spollEnd();
+        if ((sb & mask) == value) return;
+      }else{
+        spollEnd();
+      }
+    }
+    if ( tmo && ((millis() - start) > tmo) ) break;
+    if ( !tmo && dataPort.available() ) break;
+  }
+
+  seqAbort = true;
+  dataPort.println(F("Wait timed out"));
+}
+
+
+/***** Wait for a fixed time *****/
+/*
+ * Usage: ++delay n (milliseconds) | ++delay nu (microseconds)
+ */
+void delay_h(char *params) {
+  uint16_t val;
+  unsigned long start = micros();
+  char *cp;
+
+  if (params == NULL) {
+    errorMsg(1);
+    return;
+  }
+
+  cp = params + strlen(params) - 1;
+  if ( (*cp == 'u') || (*cp == 'U') ) {
+    *cp = '\0';
+    if (notInRange(params, 0, 65535, val)) return;
+    while ((micros() - start) < val) {};
+  }else{
+    if (notInRange(params, 0, 65535, val)) return;
+    delay(val);
+  }
+}
+
+
+/***** Bus diagnostics *****/
+/*
+ * Usage: xdiag mode byte
+ * mode: pins=sho state of all pins; 0=data bus; 1=control bus
+ * byte: byte to write on the bus
+ * Note: values to switch individual bits = 1,2,4,8,10,20,40,80
+ * States revert to controller or device mode after 10 seconds
+ * Databus reverts to 0 (all HIGH) after 10 seconds
+ */
+void xdiag_h(char *params){
+  char *param;
+  uint8_t mode = 0;
+  uint8_t byteval = 0;
+  
+  // Get first parameter (mode = 0 or 1)
+  param = strtok(params, " ,\t");
+
+  if ( strncasecmp(param, "pins", 4) ==0) {
+    printDbPinout();
+    printCtrlPinout();
+    return;
   }
 
   if (param != NULL) {
@@ -2392,11 +4243,12 @@ void idn_h(char * params){
  * flags & 0x01 = AR488~RDY
  * flass & 0x02 = Read^OK
  * flags & 0x04 = Send^OK
+ * flags & 0x08 = Trg^<micros> (time at which GET was sent)
  */
 void hflags_h(char * params) {
   uint16_t val;
   if (params != NULL) {
-    if (notInRange(params, 0, 7, val)) return;
+    if (notInRange(params, 0, 15, val)) return;
     gpibBus.cfg.hflags = (uint8_t)val;
   }else{
     dataPort.println(gpibBus.cfg.hflags);
@@ -2405,6 +4257,14 @@ void hflags_h(char * params) {
 
 
 /***** Fine all listeners *****/
+/*
+ * Usage: ++fndl all | n-m | addr [addr ...] | clear
+ * Results of the secondary address sweep are cached. When a primary
+ * address still responds to the group of secondary addresses on a
+ * later scan, the cached secondary addresses are reported instead of
+ * sweeping again. Use ++fndl clear to discard the cache.
+ * The results are kept in the bus map (see ++busmap).
+ */
 
 bool isRange(char * rangestr, size_t rsize, unsigned long values[2] ) {
   char * fp = NULL;
@@ -2423,6 +4283,57 @@ bool isRange(char * rangestr, size_t rsize, unsigned long values[2] ) {
 }
 
 
+/***** Check for a listener after addressing *****/
+/*
+ * Releases ATN and waits for devices that are not addressed to release
+ * NDAC. writeByte() returns while the devices have NDAC released to accept
+ * the address byte, so NDAC high only means "no listener" once NDAC has been
+ * seen asserted again. Until then, or while NDAC stays asserted, NDAC is
+ * checked until FNDL_NDAC_WAIT expires.
+ * Returns true if a listener is holding NDAC asserted.
+ */
+bool fndlListener() {
+  unsigned long start;
+  bool ndacSeen = false;
+  gpibBus.clearSignal(ATN_BIT);
+  start = micros();
+  while ((unsigned long)(micros() - start) < FNDL_NDAC_WAIT) {
+    if (gpibBus.isAsserted(NDAC_PIN)) {
+      ndacSeen = true;
+    }else if (ndacSeen) {
+      return false;
+    }
+  }
+  return gpibBus.isAsserted(NDAC_PIN);
+}
+
+
+/***** Find which secondary addresses of a primary have a listener *****/
+/*
+ * Returns a bitmap of secondary addresses (bit 0 = 0x60) found
+ */
+uint32_t fndlSweep(uint8_t pri) {
+  uint32_t found = 0;
+
+  gpibBus.assertSignal(ATN_BIT);
+  gpibBus.writeByte(GC_UNL, false);
+  gpibBus.writeByte( (pri+0x20), false ); // LAD
+
+  for (uint8_t sec=0x60; sec<0x7F; sec++){
+    gpibBus.writeByte(sec, false);
+    if (fndlListener()) found |= (1UL << (sec - 0x60));
+    // Re-address primary for next secondary address
+    gpibBus.assertSignal(ATN_BIT);
+    gpibBus.writeByte(GC_UNL, false);
+    gpibBus.writeByte((pri+0x20), false); // LAD
+  }
+
+  gpibBus.clearSignal(ATN_BIT);
+
+  return found;
+}
+
+
 void fndl_h(char *params) {
   char *param;
   uint16_t addrval = 0;
@@ -2434,17 +4345,14 @@ void fndl_h(char *params) {
   uint8_t j = 0;
   uint8_t pri = 0xFF;
   unsigned long range[2] = {0,0};
+  uint32_t found = 0;
   bool list = false;
-  bool secfound = false;
 
   // Initialise arrays
   for (int i = 0; i < 15; i++) {
     addrList[i] = 0;
   }
 
-  // Set minimal timeout
-  gpibBus.cfg.rtmo = 35;
-
   // Read parameters
   if (params == NULL) {
     // No parameters given - no action to be taken
@@ -2452,6 +4360,13 @@ void fndl_h(char *params) {
     return;
   }
 
+  // Discard cached results?
+  if ( strncasecmp(params, "clear", 5) == 0) {
+    busMap.valid = 0;
+    if (isVerb) dataPort.println(F("Listener cache cleared."));
+    return;
+  }
+
   // Is it a range?
   if ( isRange(params, strlen(params), range) ) {
     if (range[0]<30 && range[1]<31) {
@@ -2503,6 +4418,9 @@ void fndl_h(char *params) {
 
   }
 
+  // Set minimal timeout
+  gpibBus.cfg.rtmo = 35;
+
   // Poll the range of GPIB adresses
   while (i<j) {
 
@@ -2519,79 +4437,810 @@ void fndl_h(char *params) {
       continue;
     }
 
-//Serial.print("PRI: ");
-//Serial.println(pri);
-
     // Send UNL + UNT + LAD (addressDevice function adds 0x20 to pri)
     if (gpibBus.addressDevice(pri, 0xFF, TOLISTEN) == ERR) {
       errorMsg(3);
       break;
     }
 
-    gpibBus.clearSignal(ATN_BIT);
-    delayMicroseconds(1600);
+    found = 0;
 
-    if (gpibBus.isAsserted(NDAC_PIN)) {
- 
-      if (acnt>0) Serial.print(',');
+    if (fndlListener()) {
+
+      // Device claimed the primary address
+      found = FNDL_PRIMARY;
+
+    }else{
+
+      // Send all secondary addresses
+      gpibBus.assertSignal(ATN_BIT);
+      for (uint8_t sec=0x60; sec<0x7F; sec++){
+        gpibBus.writeByte(sec, false);
+      }
+
+      // Does a device claim any secondary address?
+      if (fndlListener()) {
+        if ( (busMap.valid & (1UL << pri)) && (busMap.found[pri] & ~FNDL_PRIMARY) ) {
+          // Unchanged since last scan - use cached secondary addresses
+          found = busMap.found[pri];
+        }else{
+          found = fndlSweep(pri);
+        }
+      }
+
+    } // End if NDAC aserted (else)
+
+    // Update bus map
+#ifdef BUSMAP_IDN_LEN
+    if (busMap.found[pri] != found) busMapIdn[pri][0] = '\0';
+#endif
+    busMap.found[pri] = found;
+    busMap.valid |= (1UL << pri);
+
+    // Show listeners found
+    if (found & FNDL_PRIMARY) {
+      if (acnt>0) dataPort.print(',');
       dataPort.print(pri);
       acnt++;
+    }
+    for (uint8_t sec=0; sec<31; sec++) {
+      if (found & (1UL << sec)) {
+        if (acnt>0) dataPort.print(',');
+        acnt++;
+        dataPort.print(pri);
+        dataPort.print(':');
+        dataPort.print(sec + 0x60);
+      }
+    }
+
+    gpibBus.setControls(CIDS);
+    i++;
+
+  } // END while
+
+  dataPort.println();
+  gpibBus.cfg.rtmo = tmo;
+//  if (xmit) gpibBus.sendCmd(GC_UNL);
+  gpibBus.setControls(CIDS);
+
+}
+
+
+/***** Check that a device was found at an address *****/
+/*
+ * Returns true if the address is in the bus map or the primary has not
+ * been scanned. If no listener was found, warns in verbose mode and
+ * returns false when the bus map is in strict mode.
+ */
+bool busMapCheck(uint8_t pri, uint8_t sec) {
+  uint32_t mask = (sec == 0xFF) ? FNDL_PRIMARY : (1UL << (sec - 0x60));
+  if ( !(busMap.valid & (1UL << pri)) ) return true;
+  if (busMap.found[pri] & mask) return true;
+  if (isVerb || busMap.strict) {
+    dataPort.print(F("No listener found at "));
+    dataPort.print(pri);
+    if (sec != 0xFF) {
+      dataPort.print(':');
+      dataPort.print(sec);
+    }
+    dataPort.println();
+  }
+  return !busMap.strict;
+}
+
+
+#ifdef BUSMAP_IDN_LEN
+/***** Query *IDN? from a device and store the reply in the bus map *****/
+void busMapIdnQuery(uint8_t pri, uint8_t sec) {
+  char idnq[] = "*IDN?";
+  BUFSTREAM idnBuf(busMapIdn[pri], BUSMAP_IDN_LEN);
+  char *cp;
+
+  gpibBus.addressDevice(pri, sec, TOLISTEN);
+  gpibBus.sendData(idnq, 5);
+  gpibBus.addressDevice(pri, sec, TOTALK);
+  gpibBus.receiveData(idnBuf, gpibBus.cfg.eoi, false, 0);
+  gpibBus.unAddressDevice();
+
+  // Remove the terminator
+  cp = busMapIdn[pri] + idnBuf.length();
+  while ( (cp > busMapIdn[pri]) && ((*(cp-1) == '\r') || (*(cp-1) == '\n')) ) {
+    cp--;
+    *cp = '\0';
+  }
+}
+#endif
+
+
+/***** Show and manage the bus topology map *****/
+/*
+ * Usage: ++busmap [save|clear|idn|strict [0|1]]
+ * Without parameters, returns one line per listener found by ++fndl:
+ * pri[:sec] followed by the *IDN? reply if queried, then a blank line.
+ * save writes the map to EEPROM so that it is available at power on,
+ * idn queries *IDN? from the first listener on each primary address.
+ * In strict mode, read, send and addr refuse addresses that were
+ * scanned but where no listener was found.
+ */
+void busmap_h(char *params) {
+  uint16_t val;
+  uint32_t found;
+
+  if (params != NULL) {
+    if (strncasecmp(params, "save", 4) == 0) {
+#ifdef E2END
+      epWriteData((uint8_t*)&busMap, sizeof(busMap), EE_BUSMAP);
+      if (isVerb) dataPort.println(F("Bus map saved."));
+#else
+      dataPort.println(F("EEPROM not supported."));
+#endif
+    }else if (strncasecmp(params, "clear", 5) == 0) {
+      memset(&busMap, 0, sizeof(busMap));
+#ifdef BUSMAP_IDN_LEN
+      memset(busMapIdn, 0, sizeof(busMapIdn));
+#endif
+      if (isVerb) dataPort.println(F("Bus map cleared."));
+    }else if (strncasecmp(params, "idn", 3) == 0) {
+#ifdef BUSMAP_IDN_LEN
+      for (uint8_t pri = 0; pri < 31; pri++) {
+        found = busMap.found[pri];
+        if ( !(busMap.valid & (1UL << pri)) || !found ) continue;
+        if (found & FNDL_PRIMARY) {
+          busMapIdnQuery(pri, 0xFF);
+        }else{
+          for (uint8_t sec = 0; sec < 31; sec++) {
+            if (found & (1UL << sec)) {
+              busMapIdnQuery(pri, sec + 0x60);
+              break;
+            }
+          }
+        }
+      }
+#else
+      dataPort.println(F("Disabled"));
+#endif
+    }else if (strncasecmp(params, "strict", 6) == 0) {
+      if (params[6] == '\0') {
+        dataPort.println(busMap.strict);
+        return;
+      }
+      if (notInRange(params + 7, 0, 1, val)) return;
+      busMap.strict = (uint8_t)val;
+    }else{
+      errorMsg(2);
+    }
+    return;
+  }
+
+  // Show the map
+  for (uint8_t pri = 0; pri < 31; pri++) {
+    if ( !(busMap.valid & (1UL << pri)) ) continue;
+    found = busMap.found[pri];
+#ifdef BUSMAP_IDN_LEN
+    bool idnShown = false;
+#endif
+    if (found & FNDL_PRIMARY) {
+      dataPort.print(pri);
+#ifdef BUSMAP_IDN_LEN
+      if (busMapIdn[pri][0]) {
+        dataPort.print(' ');
+        dataPort.print(busMapIdn[pri]);
+      }
+#endif
+      dataPort.println();
+    }
+    for (uint8_t sec = 0; sec < 31; sec++) {
+      if (found & (1UL << sec)) {
+        dataPort.print(pri);
+        dataPort.print(':');
+        dataPort.print(sec + 0x60);
+#ifdef BUSMAP_IDN_LEN
+        if ( !(found & FNDL_PRIMARY) && busMapIdn[pri][0] && !idnShown ) {
+          dataPort.print(' ');
+          dataPort.print(busMapIdn[pri]);
+          idnShown = true;
+        }
+#endif
+        dataPort.println();
+      }
+    }
+  }
+  dataPort.println();
+}
+
+
+/***** Take a scheduled sample *****/
+/*
+ * Sends the query to each address and returns each response as
+ * index,time_us,jitter_us,addr,response
+ * where time_us is the time since the first sample and jitter_us is how
+ * late the sample was started. Samples are scheduled from the time of
+ * the first sample so that errors do not accumulate.
+ */
+void schedService() {
+  uint32_t now = micros();
+  uint32_t late = now - schedNext;
+
+  if (late > schedLateMax) schedLateMax = late;
+  schedLateSum += late;
+
+  for (uint8_t i = 0; i < schedAcnt; i++) {
+    dataPort.print(schedIdx);
+    dataPort.print(',');
+    dataPort.print(now - schedStart);
+    dataPort.print(',');
+    dataPort.print(late);
+    dataPort.print(',');
+    dataPort.print(schedAddr[i]);
+    dataPort.print(',');
+    gpibBus.addressDevice(schedAddr[i], 0xFF, TOLISTEN);
+    gpibBus.sendData(schedQuery, strlen(schedQuery));
+    gpibBus.addressDevice(schedAddr[i], 0xFF, TOTALK);
+    if (gpibBus.receiveData(dataPort, gpibBus.cfg.eoi, false, 0)) dataPort.println();
+    gpibBus.unAddressDevice();
+  }
+
+  schedIdx++;
+  schedNext += schedPeriod;
+
+  // Skip samples that can no longer be taken on time
+  while ((int32_t)(micros() - schedNext) >= (int32_t)schedPeriod) {
+    schedNext += schedPeriod;
+    schedIdx++;
+    schedSkipped++;
+  }
+
+  if (schedLimit && (schedIdx >= schedLimit)) schedRun = false;
+}
+
+
+/***** Binary output of readings *****/
+/*
+ * Usage: ++binout 0 | 1 [batch] | 2 decimals [batch] | flush
+ * Readings received by read, auto and repeat are parsed and sent as
+ * frames of 4 byte floats (1) or fixed point integers scaled by
+ * 10^decimals (2) instead of ASCII (see NUMSTREAM). A frame is sent
+ * once it holds batch readings (1-16).
+ */
+void binout_h(char *params) {
+  char *param;
+  uint16_t format;
+  uint16_t decimals = 0;
+  uint16_t batch = 1;
+
+  if (params == NULL) {
+    dataPort.println(isBinOut);
+    return;
+  }
+
+  if (strncasecmp(params, "flush", 5) == 0) {
+    numPort.sendFrame();
+    return;
+  }
+
+  param = strtok(params, " ,\t");
+  if (notInRange(param, 0, 2, format)) return;
+  if (format == NUMS_FIXED) {
+    param = strtok(NULL, " ,\t");
+    if (param == NULL) {
+      errorMsg(1);
+      return;
+    }
+    if (notInRange(param, 0, 9, decimals)) return;
+  }
+  param = strtok(NULL, " ,\t");
+  if (param != NULL) {
+    if (notInRange(param, 1, NUMS_MAXVAL, batch)) return;
+  }
+
+  // Send any readings still waiting
+  numPort.sendFrame();
+  isBinOut = (format > 0);
+  if (isBinOut) numPort.setFormat(format, decimals, batch);
+}
+
+
+/***** Compression of data sent to the host *****/
+/*
+ * Usage: ++lz 0 | 1
+ * Data received from the bus by read, auto, repeat and in device mode
+ * is compressed (see LZSTREAM) and expanded on the host with
+ * ar488_lzdecode.py. ++lz 1 also clears the history so decoding must
+ * start from there. Without parameters, returns mode,bytes in,bytes out.
+ */
+void lz_h(char *params) {
+#ifdef LZ_WINDOW
+  uint16_t val;
+
+  if (params == NULL) {
+    dataPort.print(isLzOut);
+    dataPort.print(',');
+    dataPort.print(lzPort.bytesIn());
+    dataPort.print(',');
+    dataPort.println(lzPort.bytesOut());
+    return;
+  }
+  if (notInRange(params, 0, 1, val)) return;
+  if (val) lzPort.reset();
+  isLzOut = val;
+#else
+  params = params;
+  dataPort.println(F("Disabled"));
+#endif
+}
+
+
+/***** Storage of bus data on SD card *****/
+/*
+ * Usage: ++store open n | close | erase n | dump n | list
+ * While a file (0-31) is open, data received by read, auto and repeat,
+ * or in device mode when addressed to listen, is appended to it instead
+ * of being sent to the host. Without parameters, returns the open file
+ * (-1 if none),bytes stored,blocks written.
+ */
+void store_h(char *params) {
+#ifdef EN_STORAGE
+  char *param;
+  uint16_t fnum;
+
+  if (!storage.isReady()) {
+    dataPort.println(F("No SD card"));
+    return;
+  }
+
+  if (params == NULL) {
+    if (storage.isOpen()) {
+      dataPort.print(storage.fileNum());
+    }else{
+      dataPort.print(F("-1"));
+    }
+    dataPort.print(',');
+    dataPort.print(storage.bytesStored());
+    dataPort.print(',');
+    dataPort.println(storage.blocksWritten());
+    if (storage.writeFailed()) dataPort.println(F("Write failed!"));
+    return;
+  }
+
+  param = strtok(params, " \t");
+  if (strncasecmp(param, "close", 5) == 0) {
+    storage.close();
+    return;
+  }
+  if (strncasecmp(param, "list", 4) == 0) {
+    storage.list(dataPort);
+    dataPort.println();
+    return;
+  }
+
+  if ( (strncasecmp(param, "open", 4) == 0) || (strncasecmp(param, "erase", 5) == 0) || (strncasecmp(param, "dump", 4) == 0) ) {
+    char *fstr = strtok(NULL, " \t");
+    if (fstr == NULL) {
+      errorMsg(1);
+      return;
+    }
+    if (notInRange(fstr, 0, 31, fnum)) return;
+    if (strncasecmp(param, "open", 4) == 0) {
+      if (!storage.open(fnum)) dataPort.println(F("Failed to open file"));
+    }else if (strncasecmp(param, "erase", 5) == 0) {
+      if (!storage.erase(fnum)) dataPort.println(F("Failed to erase file"));
+    }else{
+      storage.dump(fnum, dataPort);
+    }
+    return;
+  }
+
+  errorMsg(2);
+#else
+  params = params;
+  dataPort.println(F("Disabled"));
+#endif
+}
+
+
+/***** Handshake phase latency histograms *****/
+/*
+ * Usage: ++hshist on | off | clear
+ * Without parameters, returns a header line with the upper limit (us)
+ * of each bucket, then one line per address and phase:
+ * addr,phase,count,count,... where addr 'ctl' is the controller in
+ * device mode. Phases are wait_data, read_data, data_acc (reading) and
+ * wait_rdy, data_rdy, rcv_acc (writing). Only data handshakes are timed;
+ * command bytes (ATN asserted) are accepted by all devices.
+ */
+void hshist_h(char *params) {
+#ifdef HS_HISTOGRAM
+  static const char phaseNames[HS_PHASES][10] PROGMEM = {
+    "wait_data", "read_data", "data_acc", "wait_rdy", "data_rdy", "rcv_acc"
+  };
+  char pname[10];
+  uint8_t addr;
+  uint16_t *cnt;
+  bool used;
+
+  if (params != NULL) {
+    if (strncasecmp(params, "on", 2) == 0) {
+      gpibBus.hsHist.enabled = true;
+    }else if (strncasecmp(params, "off", 3) == 0) {
+      gpibBus.hsHist.enabled = false;
+    }else if (strncasecmp(params, "clear", 5) == 0) {
+      gpibBus.clearHsHist();
+    }else{
+      errorMsg(2);
+    }
+    return;
+  }
+
+  dataPort.print(F("addr,phase"));
+  for (uint8_t b = 0; b < (HS_BUCKETS - 1); b++) {
+    dataPort.print(',');
+    dataPort.print((2UL << b) - 1);
+  }
+  dataPort.println(F(",inf"));
+
+  for (uint8_t i = 0; i < HS_HISTOGRAM; i++) {
+    addr = gpibBus.hsHist.addr[i];
+    if (addr == (HS_CTRL - 1)) break;
+    for (uint8_t p = 0; p < HS_PHASES; p++) {
+      cnt = gpibBus.hsHist.cnt[i][p];
+      used = false;
+      for (uint8_t b = 0; b < HS_BUCKETS; b++) {
+        if (cnt[b]) used = true;
+      }
+      if (!used) continue;
+      if (addr == HS_CTRL) {
+        dataPort.print(F("ctl"));
+      }else{
+        dataPort.print(addr);
+      }
+      dataPort.print(',');
+      strcpy_P(pname, phaseNames[p]);
+      dataPort.print(pname);
+      for (uint8_t b = 0; b < HS_BUCKETS; b++) {
+        dataPort.print(',');
+        dataPort.print(cnt[b]);
+      }
+      dataPort.println();
+    }
+  }
+  dataPort.println();
+#else
+  params = params;
+  dataPort.println(F("Disabled"));
+#endif
+}
+
+
+/***** Binary event trace *****/
+/*
+ * Usage: ++trace mask | clear | dump | mark n
+ * Records the events of the categories set in mask (see AR488_Trace.h)
+ * until the mask is set to 0. The trace is read in binary form with
+ * dump and decoded with src/tools/ar488_tracedecode.py. Without
+ * parameters, returns mask,records,records lost.
+ */
+void trace_h(char *params) {
+#ifdef TRACE_RING
+  char *param;
+  uint16_t val;
+
+  if (params == NULL) {
+    dataPort.print(traceMask);
+    dataPort.print(',');
+    dataPort.print(traceCount());
+    dataPort.print(',');
+    dataPort.println(traceLost());
+    return;
+  }
+
+  if (strncasecmp(params, "clear", 5) == 0) {
+    traceClear();
+  }else if (strncasecmp(params, "dump", 4) == 0) {
+    traceDump(dataPort);
+  }else if (strncasecmp(params, "mark", 4) == 0) {
+    param = strtok(params, " \t");
+    param = strtok(NULL, " \t");
+    val = 0;
+    if (param != NULL) {
+      if (notInRange(param, 0, 255, val)) return;
+    }
+    traceAdd(TE_MARK, val, 0);
+  }else{
+    if (notInRange(params, 0, 127, val)) return;
+    traceMask = val;
+  }
+#else
+  params = params;
+  dataPort.println(F("Disabled"));
+#endif
+}
+
+
+/***** Show and reset runtime statistics *****/
+/*
+ * One counter per line (name,value), then a blank line. Timeouts are
+ * listed by the handshake phase reached (gpibHandshakeStates value).
+ * serial_rx_full is the number of main loop passes that found the
+ * serial receive buffer full. It is only an indication that input may
+ * have been lost, not a count of overruns, and is not sampled while a
+ * handler (e.g. lon, ton or a bus read) is running.
+ */
+void stats_h() {
+  dataPort.print(F("rx_bytes,"));
+  dataPort.println(gpibBus.stats.rxBytes);
+  dataPort.print(F("tx_bytes,"));
+  dataPort.println(gpibBus.stats.txBytes);
+  for (uint8_t i = 0; i <= RECEIVER_ACCEPTING; i++) {
+    if (!gpibBus.stats.timeouts[i]) continue;
+    dataPort.print(F("timeout_"));
+    switch (i) {
+      case HANDSHAKE_START:         dataPort.print(F("start")); break;
+      case WAIT_FOR_DATA:           dataPort.print(F("wait_for_data")); break;
+      case READ_DATA:               dataPort.print(F("read_data")); break;
+      case DATA_ACCEPTED:           dataPort.print(F("data_accepted")); break;
+      case WAIT_FOR_RECEIVER_READY: dataPort.print(F("wait_for_receiver_ready")); break;
+      case PLACE_DATA:              dataPort.print(F("place_data")); break;
+      case DATA_READY:              dataPort.print(F("data_ready")); break;
+      case RECEIVER_ACCEPTING:      dataPort.print(F("receiver_accepting")); break;
+      default:                      dataPort.print(i);
+    }
+    dataPort.print(',');
+    dataPort.println(gpibBus.stats.timeouts[i]);
+  }
+  dataPort.print(F("ifc_aborts,"));
+  dataPort.println(gpibBus.stats.ifcAborts);
+  dataPort.print(F("atn_aborts,"));
+  dataPort.println(gpibBus.stats.atnAborts);
+  dataPort.print(F("serial_rx_full,"));
+  dataPort.println(lstats.rxFull);
+  dataPort.print(F("cmd_overflows,"));
+  dataPort.println(lstats.pbOverflow);
+  dataPort.print(F("commands,"));
+  dataPort.println(lstats.cmds);
+  dataPort.print(F("loop_max_us,"));
+  dataPort.println(lstats.tmax);
+  dataPort.print(F("loop_mean_us,"));
+  dataPort.println(lstats.loops ? (uint32_t)(lstats.tsum / lstats.loops) : 0);
+  dataPort.println();
+
+  gpibBus.clearStats();
+  memset(&lstats, 0, sizeof(lstats));
+}
+
+
+/***** Throughput benchmark *****/
+/*
+ * Usage: ++bench write [size [reps [eoi|term|both]]]
+ *        ++bench read [reps [eoi|term|both [query]]]
+ *        ++bench host [size [reps]]
+ * write: sends reps blocks of size bytes to the addressed device. The
+ * block ends with EOI on the last byte (eoi), a LF (term) or both.
+ * read: reads reps responses from the addressed device, ending on EOI
+ * or LF, sending the query first when one is given. Data is discarded.
+ * host: sends reps lines of size bytes to the host.
+ * The GPIB and host sides are measured separately so that one does not
+ * limit the other. Handshakes include addressing and query bytes, bytes
+ * only the payload. The ++stats counters are not reset.
+ */
+#define BENCH_EOI  1
+#define BENCH_TERM 2
+
+void bench_h(char *params) {
+  char *param;
+  char *query = NULL;
+  uint16_t size = 64;
+  uint16_t reps = 100;
+  uint16_t val;
+  uint8_t mode = 0;
+  uint8_t endmode = BENCH_EOI;
+  uint32_t bytes = 0;
+  uint32_t tstart;
+  uint32_t tus;
+  GPIBstats before = gpibBus.stats;
+  DEVNULL devnull;
+
+  param = (params == NULL) ? NULL : strtok(params, " \t");
+  if (param == NULL) {
+    errorMsg(1);
+    if (isVerb) dataPort.println(F("Missing parameters"));
+    return;
+  }
+  if (strncasecmp(param, "write", 5) == 0) {
+    mode = 1;
+  }else if (strncasecmp(param, "read", 4) == 0) {
+    mode = 2;
+  }else if (strncasecmp(param, "host", 4) == 0) {
+    mode = 3;
+  }else{
+    errorMsg(2);
+    return;
+  }
+
+  // Block size (not used when reading, the device decides)
+  if (mode != 2) {
+    param = strtok(NULL, " \t");
+    if (param != NULL) {
+      if (notInRange(param, 1, 65535, size)) return;
+    }
+  }
+  // Repetitions
+  param = strtok(NULL, " \t");
+  if (param != NULL) {
+    if (notInRange(param, 1, 65535, reps)) return;
+  }
+  // End of block
+  if (mode != 3) {
+    param = strtok(NULL, " \t");
+    if (param != NULL) {
+      if (strncasecmp(param, "both", 4) == 0) {
+        endmode = BENCH_EOI | BENCH_TERM;
+      }else if (strncasecmp(param, "term", 4) == 0) {
+        endmode = BENCH_TERM;
+      }else if (strncasecmp(param, "eoi", 3) != 0) {
+        errorMsg(2);
+        return;
+      }
+    }
+    if (mode == 2) query = strtok(NULL, "\n\r");
+  }
+
+  tstart = micros();
+
+  if (mode == 1) {
+    gpibBus.addressDevice(gpibBus.cfg.paddr, gpibBus.cfg.saddr, TOLISTEN);
+    for (uint16_t r = 0; r < reps; r++) {
+      gpibBus.setControls(CTAS);
+      for (val = 0; val < size; val++) {
+        bool last = (val == (size - 1));
+        uint8_t db = ((endmode & BENCH_TERM) && last) ? LF : ('A' + (val % 26));
+        if (gpibBus.writeByte(db, (endmode & BENCH_EOI) && last) != HANDSHAKE_COMPLETE) break;
+      }
+      gpibBus.setControls(CIDS);
+      bytes += val;
+      // Nothing accepted the block
+      if (val == 0) break;
+    }
+    gpibBus.unAddressDevice();
+  }else if (mode == 2) {
+    for (uint16_t r = 0; r < reps; r++) {
+      uint32_t rxb = gpibBus.stats.rxBytes;
+      if (query != NULL) {
+        gpibBus.addressDevice(gpibBus.cfg.paddr, gpibBus.cfg.saddr, TOLISTEN);
+        gpibBus.sendData(query, strlen(query));
+      }
+      gpibBus.addressDevice(gpibBus.cfg.paddr, gpibBus.cfg.saddr, TOTALK);
+      gpibBus.receiveData(devnull, (endmode & BENCH_EOI), !(endmode & BENCH_EOI), LF);
+      gpibBus.unAddressDevice();
+      rxb = gpibBus.stats.rxBytes - rxb;
+      bytes += rxb;
+      if (rxb == 0) break;
+    }
+  }else{
+    for (uint16_t r = 0; r < reps; r++) {
+      for (val = 1; val < size; val++) dataPort.write('A' + ((val - 1) % 26));
+      dataPort.write(LF);
+      bytes += size;
+    }
+    // Wait for the last bytes to leave the port
+    dataPort.flush();
+  }
+
+  tus = micros() - tstart;
+  if (tus == 0) tus = 1;
+
+  dataPort.print(F("bench,"));
+  dataPort.println(mode == 1 ? F("write") : (mode == 2 ? F("read") : F("host")));
+  dataPort.print(F("bytes,"));
+  dataPort.println(bytes);
+  dataPort.print(F("time_us,"));
+  dataPort.println(tus);
+  dataPort.print(F("bytes_per_s,"));
+  dataPort.println((uint32_t)((uint64_t)bytes * 1000000UL / tus));
+  if (mode != 3) {
+    uint32_t hs = (gpibBus.stats.rxBytes - before.rxBytes) + (gpibBus.stats.txBytes - before.txBytes);
+    uint32_t tmo = 0;
+    for (uint8_t i = 0; i <= RECEIVER_ACCEPTING; i++) {
+      tmo += (uint16_t)(gpibBus.stats.timeouts[i] - before.timeouts[i]);
+    }
+    dataPort.print(F("handshakes,"));
+    dataPort.println(hs);
+    dataPort.print(F("handshakes_per_s,"));
+    dataPort.println((uint32_t)((uint64_t)hs * 1000000UL / tus));
+    dataPort.print(F("timeouts,"));
+    dataPort.println(tmo);
+    dataPort.print(F("aborts,"));
+    dataPort.println((uint32_t)(gpibBus.stats.ifcAborts - before.ifcAborts) + (gpibBus.stats.atnAborts - before.atnAborts));
+  }
+  dataPort.println();
+}
 
-    }else{
 
-      // Send all secondary addresses
-      gpibBus.assertSignal(ATN_BIT);
-      for (uint8_t sec=0x60; sec<0x7F; sec++){
-        gpibBus.writeByte(sec, false);
-      }
-      
-      gpibBus.clearSignal(ATN_BIT);
-      delayMicroseconds(1600);
-
-      if (gpibBus.isAsserted(NDAC_PIN)) {
-        gpibBus.assertSignal(ATN_BIT);
-        gpibBus.writeByte(GC_UNL, false);
-        gpibBus.writeByte( (pri+0x20), false ); // LAD
-
-        for (uint8_t sec=0x60; sec<0x7F; sec++){
-          gpibBus.writeByte(sec, false);
-          gpibBus.clearSignal(ATN_BIT);
-          delayMicroseconds(1600);
-          if (gpibBus.isAsserted(NDAC_PIN)) {
-            if (acnt>0) dataPort.print(',');
-            acnt++;
-            dataPort.print(pri);
-            dataPort.print(':');
-            dataPort.print(sec);
-
-            gpibBus.assertSignal(ATN_BIT);
-            gpibBus.writeByte(GC_UNL, false);
-            gpibBus.writeByte((pri+0x20), false); // LAD
-          }else{
-            gpibBus.assertSignal(ATN_BIT);
-            gpibBus.writeByte(GC_UNT, false);
-          }
-//          delayMicroseconds(50);
-        }
+/***** Periodic acquisition *****/
+/*
+ * Usage: ++sched start period_ms addr[,addr...] [count] | stop | query str
+ * Sends the query (default READ?) to each address every period and
+ * returns the responses (see schedService). Without parameters, returns
+ * samples,skipped,maximum jitter,mean jitter (us).
+ */
+void sched_h(char *params) {
+  char *param;
+  char *cntstr;
+  uint16_t val;
+  uint8_t acnt = 0;
 
-        gpibBus.clearSignal(ATN_BIT);
-        delayMicroseconds(1600);
+  if (params == NULL) {
+    dataPort.print(schedIdx);
+    dataPort.print(',');
+    dataPort.print(schedSkipped);
+    dataPort.print(',');
+    dataPort.print(schedLateMax);
+    dataPort.print(',');
+    dataPort.println((schedIdx > schedSkipped) ? (schedLateSum / (schedIdx - schedSkipped)) : 0);
+    return;
+  }
 
-      }
+  if (strncasecmp(params, "stop", 4) == 0) {
+    schedRun = false;
+    return;
+  }
 
-    } // End if NDAC aserted (else)
+  if (strncasecmp(params, "query", 5) == 0) {
+    param = params + 5;
+    while (*param == ' ' || *param == '\t') param++;
+    if ( (*param == '\0') || (strlen(param) >= SCHED_QLEN) ) {
+      errorMsg(2);
+      return;
+    }
+    strcpy(schedQuery, param);
+    return;
+  }
 
-    gpibBus.setControls(CIDS);
-//    delay(50);
-    i++;
+  if (strncasecmp(params, "start", 5) != 0) {
+    errorMsg(2);
+    return;
+  }
 
-  } // END while
+  // Period
+  strtok(params, " \t");
+  param = strtok(NULL, " \t");
+  if (param == NULL) {
+    errorMsg(1);
+    return;
+  }
+  if (notInRange(param, 1, 60000, val)) return;
+  schedPeriod = (uint32_t)val * 1000;
 
-  dataPort.println();
-  gpibBus.cfg.rtmo = tmo;
-//  if (xmit) gpibBus.sendCmd(GC_UNL);
-  gpibBus.setControls(CIDS);
+  // Addresses (comma separated)
+  param = strtok(NULL, " \t");
+  if (param == NULL) {
+    errorMsg(1);
+    return;
+  }
+  cntstr = strtok(NULL, " \t");
+  schedLimit = cntstr ? strtoul(cntstr, NULL, 10) : 0;
+  param = strtok(param, ",");
+  while (param != NULL) {
+    if (acnt == SCHED_ADDRS) {
+      errorMsg(2);
+      return;
+    }
+    if (notInRange(param, 0, 30, val)) return;
+    if (val == gpibBus.cfg.caddr) {
+      errorMsg(2);
+      return;
+    }
+    schedAddr[acnt++] = val;
+    param = strtok(NULL, ",");
+  }
 
+  schedAcnt = acnt;
+  schedIdx = 0;
+  schedSkipped = 0;
+  schedLateMax = 0;
+  schedLateSum = 0;
+  schedStart = micros();
+  schedNext = schedStart;
+  schedRun = true;
 }
 
 
@@ -2652,13 +5301,16 @@ void send_h(char *params) {
 
     }
 
+    // Was a device found at the address?
+    if (!busMapCheck(pri, sec)) return;
+
     gpibBus.unAddressDevice();
     gpibBus.addressDevice(pri, sec, TOLISTEN);
     gpibBus.sendData(param, strlen(param));
 
     if (gpibBus.cfg.amode == 1) {
       gpibBus.addressDevice(pri, sec, TOTALK);
-      gpibBus.receiveData(dataPort, gpibBus.cfg.eoi, false, 0);
+      readToHost(gpibBus.cfg.eoi, false, 0);
 //      gpibBus.unAddressDevice();
     }
 
@@ -2778,6 +5430,12 @@ void attnRequired() {
   uint8_t saddrcmd = 0;
 #endif
 
+#ifdef MULTI_ADDR
+  uint8_t devPri = 0xFF;
+  uint8_t devDir = 0;
+  uint8_t slot;
+#endif
+
 #ifdef DEBUG_DEVICE_ATN
   uint8_t cmdbyteslist[cmdbuflen] = {0};
   uint8_t listbytecnt = 0;
@@ -2797,6 +5455,10 @@ void attnRequired() {
     cmdbytes[bytecnt] = db;
     bytecnt++;
 
+#ifdef PROM_CAPTURE
+    if (isProm && promCap) promRecord(db, PROM_ATN);
+#endif
+
 #ifdef DEBUG_DEVICE_ATN
     cmdbyteslist[listbytecnt] = db;
     listbytecnt++;
@@ -2809,7 +5471,16 @@ void attnRequired() {
   /***** Promiscuous mode *****/
   // Don't process anything, just listen and repeat to USB
   if (isProm) {
+#ifdef PROM_CAPTURE
+    if (promCap) {
+      promListen();
+      if (ptrigDone) promDump();
+    }else{
+      device_listen_h();
+    }
+#else
     device_listen_h();
+#endif
     gpibBus.setControls(DINI);
     return;
   }
@@ -2838,10 +5509,41 @@ void attnRequired() {
         continue;
       }
 
+#ifdef MULTI_ADDR
+      // Secondary address following the primary address of an additional address
+      if ( (devPri != 0xFF) && (db > 0x5F) && (db < 0x7F) ) {
+        slot = devFind(devPri, db);
+        devPri = 0xFF;
+        if (slot) {
+          devIdx = slot;
+          atnstat |= (devDir == DTAS) ? 0x04 : 0x02;
+          addressed = true;
+          gpibBus.setControls(devDir);
+          continue;
+        }
+      }
+      devPri = 0xFF;
+
+      // Additional primary address (may be followed by a secondary address)
+      if ( devCnt && (db > 0x1F) && (db < 0x5F) && ((db & 0x1F) != gpibBus.cfg.paddr) ) {
+        devPri = db & 0x1F;
+        devDir = (db & 0x40) ? DTAS : DLAS;
+        slot = devFind(devPri, 0xFF);
+        if (slot) {
+          devIdx = slot;
+          atnstat |= (devDir == DTAS) ? 0x04 : 0x02;
+          addressed = true;
+          gpibBus.setControls(devDir);
+        }
+        continue;
+      }
+#endif
+
       // Device is addressed to listen
       if (gpibBus.cfg.paddr == (db ^ 0x20)) { // MLA = db^0x20
         atnstat |= 0x02;
         addressed = true;
+        devIdx = 0;
         gpibBus.setControls(DLAS);
 
       // Device is addressed to talk
@@ -2849,6 +5551,7 @@ void attnRequired() {
         // Call talk handler to send data
         atnstat |= 0x04;
         addressed = true;
+        devIdx = 0;
         gpibBus.setControls(DTAS);
 
 #ifdef EN_STORAGE
@@ -2870,6 +5573,8 @@ void attnRequired() {
 
   } // ATN bytes processed
 
+  TRACE(TRC_DEVICE, TE_ATN_DONE, atnstat, gpibcmd);
+
   
   /***** If we have not been adressed then back to idle and exit loop *****/
   if (!addressed) {
@@ -2911,7 +5616,7 @@ void attnRequired() {
       saddrcmd = 0;
       atnstat |= 0x40;
   #ifdef DEBUG_DEVICE_ATN
-      showATNStatus(atnstat, ustat, cmdbyteslist, listbytecnt, rstat);
+      showATNStatus(atnstat, ustat, cmdbyteslist, listbytecnt);
   #endif
       return;
     }
@@ -2943,104 +5648,501 @@ void attnRequired() {
 
   }
 
-#ifdef DEBUG_DEVICE_ATN
-  DB_PRINT(F("ATN: Nothing to process!"),"");
-  showATNStatus(atnstat, ustat, cmdbyteslist, listbytecnt);
-#endif
+#ifdef DEBUG_DEVICE_ATN
+  DB_PRINT(F("ATN: Nothing to process!"),"");
+  showATNStatus(atnstat, ustat, cmdbyteslist, listbytecnt);
+#endif
+
+}
+
+
+#ifdef DEBUG_DEVICE_ATN
+void showATNStatus(uint8_t atnstat, uint8_t ustat, uint8_t atnbytes[], size_t bcnt) {
+
+  if (ustat & 0x01) DB_PRINT(F("unlistened."),"");
+  if (ustat & 0x02) DB_PRINT(F("untalked."),"");
+
+  if (atnstat & 0x01) DB_PRINT(F("ATN read loop completed."),"");
+  if (atnstat & 0x02) DB_PRINT(F("addressed to LISTEN."),"");
+  if (atnstat & 0x04) DB_PRINT(F("addressed to TALK."),"");
+  if (atnstat & 0x08) DB_PRINT(F("primary command received."),"");
+  if (atnstat & 0x10) DB_PRINT(F("secondary command received."),"");
+  if (atnstat & 0x20) DB_PRINT(F("primary command done."),"");
+  if (atnstat & 0x40) DB_PRINT(F("secondary command done."),"");
+  if (atnstat & 0x80) DB_PRINT(F("data transfer done."),"");
+
+  DB_HEXA_PRINT(F("ATN bytes received: "), atnbytes, bcnt);
+  DB_PRINT(bcnt,F(" ATN bytes read."));
+//  DB_PRINT(F("Error status: "),rstat);
+
+  DB_PRINT(F("END attnReceived.\n\n"),"");
+
+}
+#endif
+
+
+/***** Execute GPIB command while in device mode *****/
+void execGpibCmd(uint8_t gpibcmd){
+
+  // Respond to GPIB command
+  switch (gpibcmd) {
+    case GC_SPE:
+      // Serial Poll enable request
+#ifdef DEBUG_DEVICE_ATN
+        DB_PRINT(F("Received serial poll enable."),"");
+#endif
+        device_spe_h();
+        break;
+      case GC_SPD:
+        // Serial poll disable request
+#ifdef DEBUG_DEVICE_ATN
+        DB_PRINT(F("Received serial poll disable."),"");
+#endif
+        device_spd_h();
+        break;       
+    case GC_UNL:
+        // Unlisten
+        device_unl_h();
+        break;
+    case GC_UNT:
+        // Untalk
+        device_unt_h();
+        break;
+    case GC_SDC:
+        // Device clear (reset)
+        device_sdc_h();
+        break;
+    case GC_TCT:
+        // Take control
+        device_tct_h();
+        break;
+#ifdef REMOTE_SIGNAL_PIN
+    case GC_LLO:
+        // Remote lockout mode
+        device_llo_h();
+        break;
+    case GC_GTL:
+        // Local mode
+        device_gtl_h();
+        break;
+#endif
+  } // End switch
+
+}
+
+
+/***** Device is addressed to listen - so listen *****/
+void device_listen_h(){
+#ifdef EMU_ENTRIES
+  // Check received data against emulation table before passing it to the host
+  if (emuCnt && !isProm) {
+    char qbuf[EMU_QUERY_LEN + 10];
+    uint8_t tlen = 0;
+    BUFSTREAM qstream(qbuf, sizeof(qbuf), &dataPort);
+#ifdef MULTI_ADDR
+    devTag(qstream);
+    tlen = qstream.length();
+#endif
+    gpibBus.receiveData(qstream, false, false, 0x0);
+    if (qstream.spilled()) return;
+    emuResp = emuMatch(qbuf + tlen);
+    emuSlot = devIdx;
+    if (emuResp == 0xFF) dataPort.write((uint8_t *)qbuf, qstream.length());
+    return;
+  }
+#endif
+#ifdef MULTI_ADDR
+  if (!isProm) devTag(dataPort);
+#endif
+#ifdef EN_STORAGE
+  if (storage.isOpen() && !isProm) {
+    gpibBus.receiveData(storage, false, false, 0x0);
+    return;
+  }
+#endif
+#ifdef LZ_WINDOW
+  if (isLzOut && !isProm) {
+    gpibBus.receiveData(lzPort, false, false, 0x0);
+    lzPort.endBlock();
+    return;
+  }
+#endif
+  // Receivedata params: stream, detectEOI, detectEndByte, endByte
+  gpibBus.receiveData(dataPort, false, false, 0x0);
+}
+
+
+/***** Device is addressed to talk - so send data *****/
+void device_talk_h(){
+  DB_PRINT("LnRdy: ", lnRdy);
+  DB_PRINT("Buffer: ", pBuf);
+#ifdef EMU_ENTRIES
+  // Send the response to an emulated query. A response pending for another
+  // address is discarded so that it is not sent by the wrong device.
+  if ( (emuResp != 0xFF) && (emuSlot != devIdx) ) emuResp = 0xFF;
+  if (emuResp != 0xFF) {
+    char *resp = emuTable[emuResp].resp;
+    char stb[4];
+    if (strcmp(resp, "$STB") == 0) {
+      // Current status byte
+      sprintf(stb, "%u", gpibBus.cfg.stat);
+      resp = stb;
+    }
+    gpibBus.sendData(resp, strlen(resp));
+    emuResp = 0xFF;
+    return;
+  }
+#endif
+#ifdef TALK_QUEUE_SIZE
+  // Send the queued response with EOI on the last byte
+  if (tqLen[devIdx] > tqPtr[devIdx]) {
+    tqPtr[devIdx] += gpibBus.sendRawData(talkQueue[devIdx] + tqPtr[devIdx], tqLen[devIdx] - tqPtr[devIdx], WITH_EOI);
+    // Whole response sent? (otherwise the rest is sent when next addressed)
+    if (tqPtr[devIdx] == tqLen[devIdx]) {
+      tqLen[devIdx] = 0;
+      tqPtr[devIdx] = 0;
+    }
+    return;
+  }
+#endif
+  if (lnRdy == 2) gpibBus.sendData(pBuf, pbPtr);
+  // Flush the parse buffer and clear line ready flag
+  flushPbuf();
+  lnRdy = 0;
+}
+
+
+/***** Queue a response to be sent when addressed to talk *****/
+/*
+ * Usage: ++talkq [add data | clear]
+ * add appends data followed by the EOS terminator to the queue, so
+ * responses longer than the input buffer can be built from several
+ * lines. When the controller addresses the device to talk the whole
+ * queue is sent with EOI asserted on the final byte. Without
+ * parameters, returns the number of bytes queued. Applies to the
+ * address selected with ++maddr sel.
+ */
+void talkq_h(char *params) {
+#ifdef TALK_QUEUE_SIZE
+  uint16_t dlen;
+  uint8_t tc = 0;
+  char term[2];
+
+  if (params == NULL) {
+    dataPort.println(tqLen[devSel] - tqPtr[devSel]);
+    return;
+  }
+
+  if (strncasecmp(params, "clear", 5) == 0) {
+    tqLen[devSel] = 0;
+    tqPtr[devSel] = 0;
+    return;
+  }
+
+  if (strncasecmp(params, "add", 3) != 0) {
+    errorMsg(2);
+    return;
+  }
+
+  // Data follows "add "
+  params += 3;
+  if (*params != '\0') params++;
+  dlen = strlen(params);
+
+  // EOS terminator
+  switch (gpibBus.cfg.eos) {
+    case 0:
+      term[tc++] = CR;
+      term[tc++] = LF;
+      break;
+    case 1:
+      term[tc++] = CR;
+      break;
+    case 2:
+      term[tc++] = LF;
+      break;
+  }
+
+  if ((tqLen[devSel] + dlen + tc) > TALK_QUEUE_SIZE) {
+    dataPort.println(F("Queue full!"));
+    return;
+  }
+
+  memcpy(talkQueue[devSel] + tqLen[devSel], params, dlen);
+  tqLen[devSel] += dlen;
+  memcpy(talkQueue[devSel] + tqLen[devSel], term, tc);
+  tqLen[devSel] += tc;
+#else
+  params = params;
+  dataPort.println(F("Disabled"));
+#endif
+}
+
+
+#ifdef EMU_ENTRIES
+/***** Find a received query in the emulation table *****/
+/*
+ * Trailing terminators are ignored and the comparison is not case
+ * sensitive. Returns the table index or 0xFF if not found.
+ */
+uint8_t emuMatch(char *query) {
+  char *cp = query + strlen(query);
+  char last = '\0';
+  uint8_t idx = 0xFF;
+
+  // Ignore terminators and EOT character
+  while ( (cp > query) && ( (*(cp-1) == CR) || (*(cp-1) == LF) || (gpibBus.cfg.eot_en && (*(cp-1) == gpibBus.cfg.eot_ch)) ) ) cp--;
+  last = *cp;
+  *cp = '\0';
+
+  for (uint8_t i = 0; i < emuCnt; i++) {
+    if (strcasecmp(query, emuTable[i].query) == 0) {
+      idx = i;
+      break;
+    }
+  }
+
+  *cp = last;
+  return idx;
+}
+#endif
+
+
+/***** Configure the instrument emulation table *****/
+/*
+ * Usage: ++emu [add query|response | del n | clear]
+ * When a query in the table is received from the controller it is not
+ * passed to the host. The response is sent (with EOS and EOI as
+ * configured) when the interface is next addressed to talk. A response
+ * of $STB returns the current status byte. Adding an existing query
+ * replaces its response. Without parameters, returns the table as
+ * n:query|response lines followed by a blank line.
+ */
+void emu_h(char *params) {
+#ifdef EMU_ENTRIES
+  char *resp;
+  uint8_t idx;
+  uint16_t val;
+
+  if (params == NULL) {
+    for (uint8_t i = 0; i < emuCnt; i++) {
+      dataPort.print(i);
+      dataPort.print(':');
+      dataPort.print(emuTable[i].query);
+      dataPort.print('|');
+      dataPort.println(emuTable[i].resp);
+    }
+    dataPort.println();
+    return;
+  }
+
+  if (strncasecmp(params, "clear", 5) == 0) {
+    emuCnt = 0;
+    emuResp = 0xFF;
+    return;
+  }
+
+  if (strncasecmp(params, "del", 3) == 0) {
+    if ( (params[3] == '\0') || !emuCnt ) {
+      errorMsg(params[3] ? 2 : 1);
+      return;
+    }
+    if (notInRange(params + 4, 0, emuCnt - 1, val)) return;
+    for (idx = val; idx < (emuCnt - 1); idx++) {
+      emuTable[idx] = emuTable[idx + 1];
+    }
+    emuCnt--;
+    emuResp = 0xFF;
+    return;
+  }
+
+  if (strncasecmp(params, "add", 3) != 0) {
+    errorMsg(2);
+    return;
+  }
+
+  // Query and response
+  params += 3;
+  while ( (*params == ' ') || (*params == '\t') ) params++;
+  resp = strchr(params, '|');
+  if (resp == NULL) {
+    errorMsg(1);
+    return;
+  }
+  *resp = '\0';
+  resp++;
+  if ( (strlen(params) >= EMU_QUERY_LEN) || (strlen(resp) >= EMU_RESP_LEN) ) {
+    errorMsg(2);
+    return;
+  }
 
+  // Replace existing entry or add new one
+  idx = emuMatch(params);
+  if (idx == 0xFF) {
+    if (emuCnt == EMU_ENTRIES) {
+      dataPort.println(F("Table full!"));
+      return;
+    }
+    idx = emuCnt;
+    emuCnt++;
+    strcpy(emuTable[idx].query, params);
+  }
+  strcpy(emuTable[idx].resp, resp);
+#else
+  params = params;
+  dataPort.println(F("Disabled"));
+#endif
 }
 
 
-#ifdef DEBUG_DEVICE_ATN
-void showATNStatus(uint8_t atnstat, uint8_t ustat, uint8_t atnbytes[], size_t bcnt) {
-
-  if (ustat & 0x01) DB_PRINT(F("unlistened."),"");
-  if (ustat & 0x02) DB_PRINT(F("untalked."),"");
+#ifdef MULTI_ADDR
+/***** Find an additional address *****/
+/*
+ * Returns the address number (1 onwards) or 0 if not configured
+ */
+uint8_t devFind(uint8_t pri, uint8_t sec) {
+  for (uint8_t i = 0; i < devCnt; i++) {
+    if ( (devSlots[i].pri == pri) && (devSlots[i].sec == sec) ) return i + 1;
+  }
+  return 0;
+}
 
-  if (atnstat & 0x01) DB_PRINT(F("ATN read loop completed."),"");
-  if (atnstat & 0x02) DB_PRINT(F("addressed to LISTEN."),"");
-  if (atnstat & 0x04) DB_PRINT(F("addressed to TALK."),"");
-  if (atnstat & 0x08) DB_PRINT(F("primary command received."),"");
-  if (atnstat & 0x10) DB_PRINT(F("secondary command received."),"");
-  if (atnstat & 0x20) DB_PRINT(F("primary command done."),"");
-  if (atnstat & 0x40) DB_PRINT(F("secondary command done."),"");
-  if (atnstat & 0x80) DB_PRINT(F("data transfer done."),"");
 
-  DB_HEXA_PRINT(F("ATN bytes received: "), atnbytes, bcnt);
-  DB_PRINT(bcnt,F(" ATN bytes read."));
-//  DB_PRINT(F("Error status: "),rstat);
+/***** Assert SRQ if any address requests service *****/
+void devSrqUpdate() {
+  bool rqs = (gpibBus.cfg.stat & 0x40);
+  for (uint8_t i = 0; i < devCnt; i++) {
+    if (devSlots[i].stat & 0x40) rqs = true;
+  }
+  if (rqs) {
+    gpibBus.assertSignal(SRQ_BIT);
+  }else{
+    gpibBus.clearSignal(SRQ_BIT);
+  }
+}
 
-  DB_PRINT(F("END attnReceived.\n\n"),"");
 
+/***** Tag data received on an additional address *****/
+/*
+ * Data received while listening is preceded by @pri[,sec] and a space
+ * so that the host can tell which address it was sent to
+ */
+void devTag(Stream &out) {
+  if (!devCnt) return;
+  out.print('@');
+  if (devIdx) {
+    out.print(devSlots[devIdx-1].pri);
+    if (devSlots[devIdx-1].sec != 0xFF) {
+      out.print(',');
+      out.print(devSlots[devIdx-1].sec);
+    }
+  }else{
+    out.print(gpibBus.cfg.paddr);
+  }
+  out.print(' ');
 }
 #endif
 
 
-/***** Execute GPIB command while in device mode *****/
-void execGpibCmd(uint8_t gpibcmd){
+/***** Configure additional device addresses *****/
+/*
+ * Usage: ++maddr [add pri [sec] | clear | sel [n]]
+ * The interface also answers on each additional address with its own
+ * status byte and talk queue. pri must differ from the ++addr address. Data received is preceded by @pri[,sec].
+ * sel selects the address (0 = ++addr) that ++talkq and ++status apply
+ * to. Without parameters, returns n:pri[,sec],status lines followed by
+ * a blank line.
+ */
+void maddr_h(char *params) {
+#ifdef MULTI_ADDR
+  char *param;
+  uint16_t pri;
+  uint16_t sec = 0xFF;
 
-  // Respond to GPIB command
-  switch (gpibcmd) {
-    case GC_SPE:
-      // Serial Poll enable request
-#ifdef DEBUG_DEVICE_ATN
-        DB_PRINT(F("Received serial poll enable."),"");
-#endif
-        device_spe_h();
-        break;
-      case GC_SPD:
-        // Serial poll disable request
-#ifdef DEBUG_DEVICE_ATN
-        DB_PRINT(F("Received serial poll disable."),"");
-#endif
-        device_spd_h();
-        break;       
-    case GC_UNL:
-        // Unlisten
-        device_unl_h();
-        break;
-    case GC_UNT:
-        // Untalk
-        device_unt_h();
-        break;
-    case GC_SDC:
-        // Device clear (reset)
-        device_sdc_h();
-        break;
-    case GC_TCT:
-        // Take control
-        device_tct_h();
-        break;
-#ifdef REMOTE_SIGNAL_PIN
-    case GC_LLO:
-        // Remote lockout mode
-        device_llo_h();
-        break;
-    case GC_GTL:
-        // Local mode
-        device_gtl_h();
-        break;
-#endif
-  } // End switch
+  if (params == NULL) {
+    dataPort.print(F("0:"));
+    dataPort.print(gpibBus.cfg.paddr);
+    dataPort.print(',');
+    dataPort.println(gpibBus.cfg.stat);
+    for (uint8_t i = 0; i < devCnt; i++) {
+      dataPort.print(i + 1);
+      dataPort.print(':');
+      dataPort.print(devSlots[i].pri);
+      if (devSlots[i].sec != 0xFF) {
+        dataPort.print(',');
+        dataPort.print(devSlots[i].sec);
+      }
+      dataPort.print(',');
+      dataPort.println(devSlots[i].stat);
+    }
+    dataPort.println();
+    return;
+  }
 
-}
+  param = strtok(params, " ,\t");
 
+  if (strncasecmp(param, "clear", 5) == 0) {
+    devCnt = 0;
+    devIdx = 0;
+    devSel = 0;
+    devSrqUpdate();
+    return;
+  }
 
-/***** Device is addressed to listen - so listen *****/
-void device_listen_h(){
-  // Receivedata params: stream, detectEOI, detectEndByte, endByte
-  gpibBus.receiveData(dataPort, false, false, 0x0);
-}
+  if (strncasecmp(param, "sel", 3) == 0) {
+    param = strtok(NULL, " ,\t");
+    if (param == NULL) {
+      dataPort.println(devSel);
+      return;
+    }
+    if (notInRange(param, 0, devCnt, pri)) return;
+    devSel = (uint8_t)pri;
+    return;
+  }
 
+  if (strncasecmp(param, "add", 3) != 0) {
+    errorMsg(2);
+    return;
+  }
 
-/***** Device is addressed to talk - so send data *****/
-void device_talk_h(){
-  DB_PRINT("LnRdy: ", lnRdy);
-  DB_PRINT("Buffer: ", pBuf);
-  if (lnRdy == 2) gpibBus.sendData(pBuf, pbPtr);
-  // Flush the parse buffer and clear line ready flag
-  flushPbuf();
-  lnRdy = 0;
+  // Primary address
+  param = strtok(NULL, " ,\t");
+  if (param == NULL) {
+    errorMsg(1);
+    return;
+  }
+  if (notInRange(param, 0, 30, pri)) return;
+
+  // Secondary address
+  param = strtok(NULL, " ,\t");
+  if (param != NULL) {
+    if (notInRange(param, 0, 126, sec)) return;
+    if (sec < 31) sec += 0x60;
+    if (sec < 0x60 || sec > 0x7E) {
+      errorMsg(2);
+      return;
+    }
+  }
+
+  // The main address is handled by the primary address path, so it can not
+  // be used for an additional address even with a secondary address
+  if ( (pri == gpibBus.cfg.paddr) || devFind(pri, sec) ) {
+    errorMsg(2);
+    if (isVerb) dataPort.println(F("Address already in use!"));
+    return;
+  }
+  if (devCnt == MULTI_ADDR) {
+    dataPort.println(F("No free address!"));
+    return;
+  }
+  devSlots[devCnt].pri = pri;
+  devSlots[devCnt].sec = sec;
+  devSlots[devCnt].stat = 0;
+  devCnt++;
+#else
+  params = params;
+  dataPort.println(F("Disabled"));
+#endif
 }
 
 
@@ -3072,7 +6174,22 @@ void device_spe_h() {
   DB_PRINT(F("Serial poll request received from controller ->"),"");
 #endif
   // Send the status byte
+#ifdef MULTI_ADDR
+  if (devIdx) {
+    // Send the status byte of the additional address
+    uint8_t mstat = gpibBus.cfg.stat;
+    gpibBus.cfg.stat = devSlots[devIdx-1].stat;
+    gpibBus.sendStatus();
+    devSlots[devIdx-1].stat = gpibBus.cfg.stat;
+    gpibBus.cfg.stat = mstat;
+  }else{
+    gpibBus.sendStatus();
+  }
+  // Keep SRQ asserted while any address still requests service
+  devSrqUpdate();
+#else
   gpibBus.sendStatus();
+#endif
 #ifdef DEBUG_DEVICE_ATN
   DB_PRINT(F("Status sent: "), (stat & ~0x40));
 #endif
@@ -3139,6 +6256,13 @@ void lonMode(){
   enum gpibHandshakeStates state;
   bool eoiDetected = false;
 
+#ifdef LON_BUFFER
+  if (isLonBuf) {
+    lonBufMode();
+    return;
+  }
+#endif
+
   // Set bus for device listner active mode
   gpibBus.setControls(DLAS);
 
@@ -3168,9 +6292,252 @@ void lonMode(){
 }
 
 
+#ifdef LON_BUFFER
+/***** Report the end of a buffered listen-only capture *****/
+void lonReport(uint32_t bytes, uint32_t duration, uint16_t maxfill) {
+  dataPort.print(F("\r\nLON capture: "));
+  dataPort.print(bytes);
+  dataPort.print(F(" bytes in "));
+  dataPort.print(duration);
+  dataPort.print(F(" ms, max buffered "));
+  dataPort.println(maxfill);
+}
+
+
+/***** Buffered listen-only mode *****/
+/*
+ * Bytes are accepted from the bus whenever there is room in the ring
+ * buffer. NRFD stays asserted after a byte only until the next read,
+ * which follows straight away unless the serial port is being fed, so
+ * the talker is mostly held up while a byte is read or when the buffer
+ * is full. The buffer is sent to the host without waiting on the serial
+ * port while data is arriving. A capture ends after lonIdle ms without
+ * data. The buffer and counts are kept while a command from the host is
+ * executed.
+ */
+void lonBufMode(){
+  uint8_t db = 0;
+  enum gpibHandshakeStates state;
+  bool eoiDetected = false;
+  bool gotByte;
+  uint16_t n;
+  int16_t room;
+  static uint16_t head = 0;
+  static uint16_t tail = 0;
+  static uint16_t cnt = 0;
+  static uint16_t maxfill = 0;
+  static uint32_t bytes = 0;
+  static uint32_t tstart = 0;
+  static uint32_t tlast = 0;
+
+  // Set bus for device listner active mode
+  gpibBus.setControls(DLAS);
+
+  while (isRO) {
+
+    // Read a byte if there is room (short wait for data so that the buffer
+    // keeps moving; a byte that has started is always completed)
+    gotByte = false;
+    if (cnt < LON_BUFFER) {
+      state = gpibBus.readByte(&db, false, &eoiDetected, 2);
+      if (state == HANDSHAKE_COMPLETE) {
+        lonBuf[head] = db;
+        head = (head + 1) % LON_BUFFER;
+        cnt++;
+        if (cnt > maxfill) maxfill = cnt;
+        tlast = millis();
+        if (!bytes) tstart = tlast;
+        bytes++;
+        gotByte = true;
+      }
+    }
+
+    // Pass on what the serial port can take without waiting. Wait only
+    // when the buffer is full or the bus is quiet.
+    if (cnt) {
+      room = dataPort.availableForWrite();
+      if (!gotByte || (cnt == LON_BUFFER)) {
+        if (room < 64) room = 64;
+      }
+      n = LON_BUFFER - tail;
+      if (n > cnt) n = cnt;
+      if ((int16_t)n > room) n = room;
+      if (n) {
+        dataPort.write(&lonBuf[tail], n);
+        tail = (tail + n) % LON_BUFFER;
+        cnt -= n;
+      }
+    }
+
+    // End of capture?
+    if (bytes && !cnt && ((millis() - tlast) >= lonIdle)) {
+      lonReport(bytes, tlast - tstart, maxfill);
+      bytes = 0;
+      maxfill = 0;
+    }
+
+    // Check whether there are charaters waiting in the serial input buffer and call handler
+    if (dataPort.available()) {
+
+      lnRdy = serialIn_h();
+
+      // We have a command so return to main loop and execute it
+      if (lnRdy==1) break;
+
+      // Clear the buffer to prevent it getting blocked
+      if (lnRdy==2) flushPbuf();
+
+    }
+
+  }
+
+  // Listen-only mode ended so send anything left in the buffer
+  if (!isRO) {
+    while (cnt) {
+      dataPort.write(lonBuf[tail]);
+      tail = (tail + 1) % LON_BUFFER;
+      cnt--;
+    }
+    if (bytes) lonReport(bytes, tlast - tstart, maxfill);
+    bytes = 0;
+    maxfill = 0;
+  }
+
+  // Set bus to idle
+  gpibBus.setControls(DIDS);
+
+}
+#endif
+
+
 /***** Talk only mpode *****/
+#ifdef TON_BUFFER
+/***** Write bytes from the talk-only ring buffer to the bus *****/
+/*
+ * Writes up to maxcnt bytes. A byte that is not accepted in time stays
+ * in the buffer to be sent again.
+ */
+void tonWrite(uint16_t maxcnt) {
+  uint8_t db;
+
+  while (ton.cnt && maxcnt) {
+    db = ton.buf[ton.tail];
+    if (gpibBus.writeByte(db, ((ton.eom >= 0) && (db == ton.eom))) != HANDSHAKE_COMPLETE) {
+      ton.errors++;
+      if (ton.stalls < 255) ton.stalls++;
+      return;
+    }
+    ton.stalls = 0;
+    ton.tail = (ton.tail + 1) % TON_BUFFER;
+    ton.cnt--;
+    maxcnt--;
+    ton.tlast = millis();
+    if (!ton.bytes) ton.tfirst = ton.tlast;
+    ton.bytes++;
+  }
+}
+
+
+/***** Add a byte to the talk-only ring buffer (discarded when full) *****/
+void tonPut(uint8_t db) {
+  if (ton.cnt >= TON_BUFFER) {
+    ton.lost++;
+    return;
+  }
+  ton.buf[ton.head] = db;
+  ton.head = (ton.head + 1) % TON_BUFFER;
+  ton.cnt++;
+}
+
+
+/***** Show talk-only throughput *****/
+void tonStats() {
+  uint32_t tms = ton.tlast - ton.tfirst;
+  dataPort.print(ton.bytes);
+  dataPort.print(',');
+  dataPort.print(tms);
+  dataPort.print(',');
+  dataPort.print(tms ? (ton.bytes * 1000UL / tms) : 0);
+  dataPort.print(',');
+  dataPort.print(ton.errors);
+  dataPort.print(',');
+  dataPort.println(ton.lost);
+}
+
+
+/***** Burst talk-only mode *****/
+/*
+ * Serial input is collected in the ring buffer and written to the bus
+ * in bursts of up to TON_BURST bytes. A line starting with ++ is a
+ * command: data received before it is sent first, then the command is
+ * passed to the main loop. When the listeners stop accepting data and
+ * the buffer is full, serial input is still read so that a command
+ * (e.g. ++ton 0) gets through; data that does not fit is discarded and
+ * counted as lost.
+ */
+void tonBufMode(){
+  uint8_t c;
+  uint16_t errs;
+
+  // Set bus for device taker active mode
+  gpibBus.setControls(DTAS);
+
+  while (isTO == 3) {
+
+    // Move serial input to the buffer (leaving room for a held back ++)
+    while (dataPort.available() && ((ton.cnt < (TON_BUFFER - 2)) || (ton.stalls >= TON_STALL))) {
+      c = dataPort.read();
+      if (pbPtr || (ton.bol && (c == PLUS))) {
+        // Possible command line: hold it in the parse buffer
+        if ((c == CR) || (c == LF)) {
+          if (isCmd(pBuf)) {
+            // Send what came before the command then return to the main loop
+            errs = ton.errors;
+            while (ton.cnt && ((ton.errors - errs) < 3)) tonWrite(TON_BURST);
+            lnRdy = 1;
+            gpibBus.setControls(DIDS);
+            return;
+          }
+        }else if (pbPtr < (PBSIZE - 1)) {
+          addPbuf(c);
+          if ((pbPtr < 2) || isCmd(pBuf)) continue;
+        }else{
+          // Command too long so discard it
+          flushPbuf();
+          ton.bol = false;
+          continue;
+        }
+        // Not a command after all so send it as data
+        for (uint8_t i = 0; i < pbPtr; i++) tonPut(pBuf[i]);
+        flushPbuf();
+        if ((c == CR) || (c == LF)) tonPut(c);
+      }else{
+        tonPut(c);
+      }
+      ton.bol = ((c == CR) || (c == LF));
+    }
+
+    // Write a burst to the bus
+    if (ton.cnt) tonWrite(TON_BURST);
+
+  }
+
+  // Set bus to idle
+  gpibBus.setControls(DIDS);
+
+}
+#endif
+
+
 void tonMode(){
 
+#ifdef TON_BUFFER
+  if (isTO == 3) {
+    tonBufMode();
+    return;
+  }
+#endif
+
   // Set bus for device taker active mode
   gpibBus.setControls(DTAS);
 
@@ -57,6 +57,366 @@ int DEVNULL::lastByte()
 
 
 
+/***** Buffer stream *****/
+
+BUFSTREAM::BUFSTREAM(char *buffer, size_t size, Stream *spill)
+{
+  _buf = buffer;
+  _size = size;
+  _spill = spill;
+  clear();
+}
+
+int BUFSTREAM::available()
+{
+  return _len - _rdptr;
+}
+
+int BUFSTREAM::peek()
+{
+  if (_rdptr < _len) return (uint8_t)_buf[_rdptr];
+  return EOF;
+}
+
+int BUFSTREAM::read()
+{
+  if (_rdptr < _len) return (uint8_t)_buf[_rdptr++];
+  return EOF;
+}
+
+void BUFSTREAM::flush()
+{
+  return;
+}
+
+size_t BUFSTREAM::write(const uint8_t data)
+{
+  if (_spilled) return _spill->write(data);
+  // Keep space for the null terminator
+  if (_len >= (_size - 1)) {
+    if (!_spill) return 0;
+    // Buffer full so pass on buffered data and continue on spill stream
+    _spill->write((uint8_t *)_buf, _len);
+    _spilled = true;
+    return _spill->write(data);
+  }
+  _buf[_len++] = data;
+  _buf[_len] = '\0';
+  return 1;
+}
+
+size_t BUFSTREAM::length()
+{
+  return _len;
+}
+
+void BUFSTREAM::clear()
+{
+  _len = 0;
+  _rdptr = 0;
+  _spilled = false;
+  if (_size) _buf[0] = '\0';
+}
+
+bool BUFSTREAM::spilled()
+{
+  return _spilled;
+}
+
+
+
+/***** Numeric conversion stream *****/
+
+NUMSTREAM::NUMSTREAM(Stream &output)
+{
+  _out = &output;
+  _flen = 0;
+  _vcnt = 0;
+  setFormat(NUMS_FLOAT, 0, 1);
+}
+
+int NUMSTREAM::available()
+{
+  return 0;
+}
+
+int NUMSTREAM::peek()
+{
+  return EOF;
+}
+
+int NUMSTREAM::read()
+{
+  return EOF;
+}
+
+void NUMSTREAM::flush()
+{
+  return;
+}
+
+size_t NUMSTREAM::write(const uint8_t data)
+{
+  // Separators (including line terminators and the EOT character)
+  if ( (data <= ' ') || (data == ',') || (data == ';') ) {
+    endField();
+  }else{
+    // Ignore characters beyond any valid number
+    if (_flen < (sizeof(_field) - 1)) _field[_flen++] = data;
+  }
+  return 1;
+}
+
+void NUMSTREAM::setFormat(uint8_t format, uint8_t decimals, uint8_t batch)
+{
+  _format = format;
+  _decimals = decimals;
+  _batch = (batch && (batch <= NUMS_MAXVAL)) ? batch : 1;
+}
+
+void NUMSTREAM::endField()
+{
+  char *endp;
+  double val;
+  float fval;
+  int32_t ival = INT32_MIN;
+  bool valid;
+
+  if (!_flen) return;
+  _field[_flen] = '\0';
+  _flen = 0;
+
+  val = strtod(_field, &endp);
+  valid = (endp != _field) && (*endp == '\0');
+
+  if (_format == NUMS_FIXED) {
+    if (valid) {
+      for (uint8_t i = 0; i < _decimals; i++) val *= 10;
+      if ( (val < 2147483647.0) && (val > -2147483647.0) ) ival = (int32_t)(val < 0 ? val - 0.5 : val + 0.5);
+    }
+    memcpy(&_vals[_vcnt * 4], &ival, 4);
+  }else{
+    fval = valid ? (float)val : NAN;
+    memcpy(&_vals[_vcnt * 4], &fval, 4);
+  }
+
+  _vcnt++;
+  if (_vcnt == NUMS_MAXVAL) sendFrame();
+}
+
+void NUMSTREAM::endResponse()
+{
+  endField();
+  if (_vcnt >= _batch) sendFrame();
+}
+
+void NUMSTREAM::sendFrame()
+{
+  if (!_vcnt) return;
+  _out->write((uint8_t)(0xB0 + _format));
+  _out->write(_vcnt);
+  _out->write(_vals, _vcnt * 4);
+  _vcnt = 0;
+}
+
+
+
+#ifdef LZ_WINDOW
+/***** Compressing stream *****/
+
+LZSTREAM::LZSTREAM(Stream &output)
+{
+  _out = &output;
+  reset();
+}
+
+int LZSTREAM::available()
+{
+  return 0;
+}
+
+int LZSTREAM::peek()
+{
+  return EOF;
+}
+
+int LZSTREAM::read()
+{
+  return EOF;
+}
+
+void LZSTREAM::flush()
+{
+  return;
+}
+
+/***** Byte written 'back' bytes ago (1 = last byte) *****/
+uint8_t LZSTREAM::histAt(uint16_t back)
+{
+  return _hist[(_hpos + LZ_WINDOW - back) % LZ_WINDOW];
+}
+
+void LZSTREAM::addHist(uint8_t data)
+{
+  _hist[_hpos] = data;
+  _hpos = (_hpos + 1) % LZ_WINDOW;
+  if (_hcnt < LZ_WINDOW) _hcnt++;
+}
+
+size_t LZSTREAM::write(const uint8_t data)
+{
+  uint16_t dmax = (_hcnt < 255) ? _hcnt : 255;
+  uint16_t d;
+  uint16_t k;
+  bool found = false;
+
+  if (!_inBlock) {
+    _out->write(LZ_BLOCK);
+    _bytesOut++;
+    _inBlock = true;
+  }
+  _bytesIn++;
+
+  if (_mlen) {
+    if (_mlen < LZ_MAXLEN) {
+      if (histAt(_mdist) == data) {
+        found = true;
+      }else{
+        // Look further back for the pending bytes followed by this one
+        for (d = _mdist + 1; (d <= dmax) && ((d + _mlen) <= _hcnt); d++) {
+          if (histAt(d) != data) continue;
+          for (k = 1; k <= _mlen; k++) {
+            if (histAt(k) != histAt(k + d)) break;
+          }
+          if (k > _mlen) {
+            _mdist = d;
+            found = true;
+            break;
+          }
+        }
+      }
+    }
+    // Too short for a match: send the oldest pending byte as a literal and
+    // look for a match starting at the next one
+    while (!found && _mlen && (_mlen < LZ_MINMATCH)) {
+      putItem(false, histAt(_mlen));
+      _mlen--;
+      for (d = 1; (d <= dmax) && ((d + _mlen) <= _hcnt); d++) {
+        if (histAt(d) != data) continue;
+        for (k = 1; k <= _mlen; k++) {
+          if (histAt(k) != histAt(k + d)) break;
+        }
+        if (k > _mlen) {
+          _mdist = d;
+          found = true;
+          break;
+        }
+      }
+    }
+    if (found) {
+      _mlen++;
+      addHist(data);
+      return 1;
+    }
+    endMatch();
+  }
+
+  // Start a new match at the nearest earlier occurrence of this byte
+  for (d = 1; d <= dmax; d++) {
+    if (histAt(d) == data) break;
+  }
+  if (d <= dmax) {
+    _mdist = d;
+    _mlen = 1;
+  }else{
+    putItem(false, data);
+  }
+  addHist(data);
+  return 1;
+}
+
+/***** Send the pending bytes as a match or as literals *****/
+void LZSTREAM::endMatch()
+{
+  if (_mlen >= LZ_MINMATCH) {
+    putMatch(_mdist, _mlen);
+  }else{
+    for (uint16_t k = _mlen; k > 0; k--) putItem(false, histAt(k));
+  }
+  _mlen = 0;
+}
+
+void LZSTREAM::putItem(bool isMatch, uint8_t val)
+{
+  if (_gcnt == 0) {
+    _grp[0] = 0;
+    _glen = 1;
+  }
+  if (isMatch) _grp[0] |= (1 << _gcnt);
+  _grp[_glen++] = val;
+  _gcnt++;
+  if (_gcnt == 8) sendGroup();
+}
+
+void LZSTREAM::putMatch(uint8_t dist, uint16_t len)
+{
+  if (_gcnt == 0) {
+    _grp[0] = 0;
+    _glen = 1;
+  }
+  _grp[0] |= (1 << _gcnt);
+  _grp[_glen++] = dist;
+  _grp[_glen++] = (uint8_t)(len - LZ_MINMATCH);
+  _gcnt++;
+  if (_gcnt == 8) sendGroup();
+}
+
+void LZSTREAM::sendGroup()
+{
+  if (!_gcnt) return;
+  _out->write(_grp, _glen);
+  _bytesOut += _glen;
+  _gcnt = 0;
+  _glen = 0;
+}
+
+/***** Send any pending data and end the block *****/
+void LZSTREAM::endBlock()
+{
+  if (!_inBlock) return;
+  endMatch();
+  putItem(true, 0);
+  sendGroup();
+  _inBlock = false;
+}
+
+/***** Clear the history and counters *****/
+void LZSTREAM::reset()
+{
+  _hpos = 0;
+  _hcnt = 0;
+  _mdist = 0;
+  _mlen = 0;
+  _gcnt = 0;
+  _glen = 0;
+  _inBlock = false;
+  _bytesIn = 0;
+  _bytesOut = 0;
+}
+
+uint32_t LZSTREAM::bytesIn()
+{
+  return _bytesIn;
+}
+
+uint32_t LZSTREAM::bytesOut()
+{
+  return _bytesOut;
+}
+#endif
+
+
+
 /***************************************/
 /***** Serial Port implementations *****/
 /***************************************/
@@ -34,6 +34,146 @@ private:
 };
 
 
+/***** Buffer stream *****/
+/*
+ * A stream that writes into and reads from a fixed character buffer.
+ * Used to capture data received from the GPIB bus (e.g. a query
+ * response) for processing within the interface. Written data is
+ * always null terminated. Data beyond the buffer size is discarded
+ * unless a spill stream is given, in which case the buffered data and
+ * everything written after it is passed on to the spill stream.
+ */
+
+class BUFSTREAM : public Stream
+{
+public:
+  BUFSTREAM(char *buffer, size_t size, Stream *spill = NULL);
+
+  int    available();
+  int    peek();
+  int    read();
+  void   flush();
+
+  size_t write(const uint8_t data);
+
+  size_t length();
+  void   clear();
+  bool   spilled();
+
+private:
+  char   *_buf;
+  size_t _size;
+  size_t _len;
+  size_t _rdptr;
+  Stream *_spill;
+  bool   _spilled;
+};
+
+
+/***** Numeric conversion stream *****/
+/*
+ * Parses ASCII numbers written to it (separated by commas, semicolons,
+ * spaces or control characters) and writes them to the output stream
+ * in binary frames:
+ * 0xB0 + format, count, count x 4 byte values (little endian)
+ * Format 1 = float, format 2 = fixed point integer (value x 10^decimals).
+ * Fields that are not numbers are sent as NaN or INT32_MIN. A frame is
+ * sent when it holds 'batch' values (call endResponse() after each
+ * response) or flushed with sendFrame().
+ */
+
+#define NUMS_FLOAT 1
+#define NUMS_FIXED 2
+#define NUMS_MAXVAL 16
+
+class NUMSTREAM : public Stream
+{
+public:
+  NUMSTREAM(Stream &output);
+
+  int    available();
+  int    peek();
+  int    read();
+  void   flush();
+
+  size_t write(const uint8_t data);
+
+  void   setFormat(uint8_t format, uint8_t decimals, uint8_t batch);
+  void   endResponse();
+  void   sendFrame();
+
+private:
+  Stream  *_out;
+  char    _field[24];
+  uint8_t _flen;
+  uint8_t _format;
+  uint8_t _decimals;
+  uint8_t _batch;
+  uint8_t _vcnt;
+  uint8_t _vals[NUMS_MAXVAL * 4];
+  void    endField();
+};
+
+
+#ifdef LZ_WINDOW
+/***** Compressing stream *****/
+/*
+ * LZ77 style compressor for slow host links. Data written to it is sent
+ * to the output stream in blocks:
+ * 0xCC, then groups of a control byte followed by up to 8 items.
+ * Bit n (LSB first) of the control byte set means item n is a match:
+ *   distance (1 byte, 1-255), length - 3 (1 byte) = copy length bytes
+ *   starting distance bytes back in the output.
+ * Otherwise item n is a literal byte. A match with distance 0 (single
+ * byte) ends the block. History is kept from one block to the next so
+ * that blocks must be decoded in order from the last reset().
+ * Matches are found by a search of the LZ_WINDOW byte history window.
+ */
+
+#define LZ_BLOCK 0xCC
+#define LZ_MINMATCH 3
+#define LZ_MAXLEN (255 + LZ_MINMATCH)
+
+class LZSTREAM : public Stream
+{
+public:
+  LZSTREAM(Stream &output);
+
+  int    available();
+  int    peek();
+  int    read();
+  void   flush();
+
+  size_t write(const uint8_t data);
+
+  void   reset();
+  void   endBlock();
+  uint32_t bytesIn();
+  uint32_t bytesOut();
+
+private:
+  Stream   *_out;
+  uint8_t  _hist[LZ_WINDOW];
+  uint16_t _hpos;
+  uint16_t _hcnt;
+  uint8_t  _mdist;
+  uint16_t _mlen;
+  uint8_t  _grp[17];
+  uint8_t  _glen;
+  uint8_t  _gcnt;
+  bool     _inBlock;
+  uint32_t _bytesIn;
+  uint32_t _bytesOut;
+  uint8_t  histAt(uint16_t back);
+  void     addHist(uint8_t data);
+  void     putItem(bool isMatch, uint8_t val);
+  void     putMatch(uint8_t dist, uint16_t len);
+  void     sendGroup();
+  void     endMatch();
+};
+#endif
+
+
 /*
  * Serial Port definition
  */
@@ -213,6 +213,181 @@
 //#define SAY_HELLO
 
 
+/***** SRQ interrupt and event queue *****/
+/*
+ * Uncomment SRQ_INTERRUPT to capture the assertion of SRQ with a pin
+ * interrupt so that the time of the service request is recorded even
+ * while the interface is busy (e.g. reading data). The SRQ pin must
+ * support external interrupts (on AVR boards see
+ * digitalPinToInterrupt()). Not available with the MCP23S17.
+ * Uncomment SRQ_QUEUE_SIZE to enable ++srqauto 2, which places the
+ * status byte of the requesting device into a queue of that many
+ * events, read with ++srqq.
+ */
+//#define SRQ_INTERRUPT
+//#define SRQ_QUEUE_SIZE 8
+
+
+/***** Status byte history *****/
+/*
+ * Uncomment to keep a history of status bytes returned by serial
+ * polls (++spoll, ++allspoll and srqauto) for each address. A new
+ * entry is recorded each time the status byte of a device changes.
+ * The history is read with ++sthist. The value is the number of
+ * entries kept per address. Uses 31 x (5 x entries + 2) bytes of RAM.
+ */
+//#define SPOLL_HISTORY 4
+
+
+/***** Bus map device identification *****/
+/*
+ * Uncomment to allow ++busmap idn to query *IDN? from each device
+ * found by ++fndl and show the reply in the bus map. The value is the
+ * maximum length of the reply kept. Uses 31 x length bytes of RAM.
+ */
+//#define BUSMAP_IDN_LEN 32
+
+
+/***** Device mode talk queue *****/
+/*
+ * Uncomment to allow the host to queue responses with ++talkq that
+ * are longer than the input buffer. The queue is sent to the
+ * controller in one transfer when the interface is addressed to talk.
+ * The value is the size of the queue in bytes.
+ */
+//#define TALK_QUEUE_SIZE 1024
+
+
+/***** Device mode instrument emulation *****/
+/*
+ * Uncomment to allow a table of queries and canned responses to be
+ * configured with ++emu. Matching queries received from the controller
+ * are answered by the interface without passing through the host.
+ * EMU_ENTRIES is the number of table entries. Each entry uses
+ * EMU_QUERY_LEN + EMU_RESP_LEN bytes of RAM.
+ */
+//#define EMU_ENTRIES 8
+#ifdef EMU_ENTRIES
+  #define EMU_QUERY_LEN 16
+  #define EMU_RESP_LEN 48
+#endif
+
+
+/***** Device mode additional addresses *****/
+/*
+ * Uncomment to allow the interface to answer on additional primary
+ * or primary+secondary addresses (++maddr) so that it can stand in for
+ * several instruments. Each address has its own status byte and, if
+ * enabled, its own talk queue (TALK_QUEUE_SIZE bytes each). The value
+ * is the number of additional addresses.
+ */
+//#define MULTI_ADDR 3
+
+
+/***** Promiscuous mode capture *****/
+/*
+ * Uncomment to allow bus traffic to be captured with ++prom 2. Each byte
+ * handshaked on the bus, including commands sent with ATN asserted, is
+ * recorded with its ATN/EOI state and a microsecond timestamp in a
+ * ring buffer. The buffer is read in binary form with ++prom dump and
+ * decoded with src/tools/ar488_promdecode.py. The value is the number of
+ * records kept. Uses 6 bytes of RAM per record (8 on 32 bit boards).
+ */
+//#define PROM_CAPTURE 256
+
+
+/***** Compression of data sent to the host *****/
+/*
+ * Uncomment to allow data received from the GPIB bus to be compressed
+ * before it is sent to the host (++lz 1), e.g. for slow Bluetooth or
+ * WiFi bridge links. The output is expanded on the host with
+ * src/tools/ar488_lzdecode.py. The value is the size of the history
+ * window searched for repeated data (up to 256 bytes of RAM). A larger
+ * window compresses better but takes longer to search.
+ */
+//#define LZ_WINDOW 128
+
+
+/***** Buffered listen-only capture *****/
+/*
+ * Uncomment to allow plotter or printer output to be captured with
+ * ++lon 2. Bytes are read from the bus into a RAM ring buffer and sent
+ * on to the host as the serial port can take them, so that a slow host
+ * does not hold up the instrument until the buffer is full. The value
+ * is the size of the buffer in bytes.
+ */
+//#define LON_BUFFER 1024
+
+
+/***** Buffered talk-only mode *****/
+/*
+ * Uncomment to allow data from the host to be sent to listeners in
+ * bursts with ++ton 3. Serial input is collected in a RAM ring buffer
+ * while the bus is written from it, and EOI can be sent with a chosen
+ * end of message character. The value is the size of the buffer in
+ * bytes.
+ */
+//#define TON_BUFFER 256
+
+
+/***** Handshake latency histograms *****/
+/*
+ * Uncomment to time each phase of the GPIB handshake (++hshist on) and
+ * collect the times in log scale histograms per device address, to
+ * show whether an instrument is slow to talk or slow to accept data.
+ * The value is the number of addresses tracked (the device mode
+ * controller counts as one). Uses 144 bytes of RAM per address.
+ */
+//#define HS_HISTOGRAM 4
+
+
+/***** Binary event trace *****/
+/*
+ * Uncomment to allow bus and command events to be recorded at runtime
+ * with ++trace (see AR488_Trace.h). Records are kept in RAM and read
+ * after the fact with ++trace dump, so that tracing does not print
+ * while the bus is active the way the DEBUG options below do. The value
+ * is the number of records kept. Uses 8 bytes of RAM per record.
+ */
+//#define TRACE_RING 64
+
+
+/***** Storage of bus data on SD card *****/
+/*
+ * Uncomment to allow data received from the GPIB bus to be stored on an
+ * SD card connected to the SPI bus (requires the SD library). Data is
+ * appended to numbered files with ++store in either mode. In device mode,
+ * a controller can also store data to, and read it back from, file n
+ * by addressing the interface with secondary address n. STORAGE_CS_PIN is
+ * the SD card chip select pin. The card uses the hardware SPI pins of the
+ * board, so only layouts that leave these free (or share them with the
+ * MCP23S17) are supported. The chip select pin must not be one of the
+ * GPIB pins either. STORAGE_BLOCK is the number of bytes buffered in RAM
+ * before a write to the card.
+ */
+//#define EN_STORAGE
+#ifdef EN_STORAGE
+  #if defined(AR488_MCP23S17)
+    #define STORAGE_CS_PIN 4      // SPI bus shared with the MCP23S17 (MCP_SELECTPIN)
+  #elif defined(AR488_MEGA644P_MCGRAW)
+    #define STORAGE_CS_PIN 4      // SS
+  #elif defined(AR488_328PB_ALT)
+    #define STORAGE_CS_PIN 10     // SS
+  #elif defined(ESP32_S2_161)
+    #define STORAGE_CS_PIN 34     // FSPI SS
+  #elif defined(AR488_CUSTOM)
+    //#define STORAGE_CS_PIN 4    // Set for the custom layout
+  #else
+    #error "EN_STORAGE: the SPI pins are used by the GPIB bus in this board layout"
+  #endif
+  #ifdef __AVR__
+    #define STORAGE_BLOCK 128
+  #else
+    #define STORAGE_BLOCK 512
+  #endif
+#endif
+
+
 
 /***** DEBUG LEVEL OPTIONS *****/
 /*
@@ -307,6 +482,14 @@
 //#define USE_MACROS    // Enable the macro feature
 //#define RUN_STARTUP   // Run MACRO_0 (the startup macro)
 
+/*
+ * Macros can also be defined at runtime with ++macro def n and are
+ * then stored in EEPROM where they replace the macro of the same
+ * number below. MACRO_STORE is the number of bytes of EEPROM used.
+ * Requires a board with EEPROM (not available on ESP boards).
+ */
+#define MACRO_STORE 512
+
 #ifdef USE_MACROS
 
 /***** Startup Macro *****/
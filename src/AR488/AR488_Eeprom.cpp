@@ -56,13 +56,13 @@ void epErase() {
 
 /***** Write data to EEPROM (with CRC) *****/
 /*
- * addr = EEPROM address
+ * blkaddr = EEPROM address of block (CRC followed by data)
  * cfg = config data union object
  * csize = size of config data object
  */
-void epWriteData(uint8_t cfgdata[], uint16_t cfgsize) {
+void epWriteData(uint8_t cfgdata[], uint16_t cfgsize, uint16_t blkaddr) {
   uint16_t crc;
-  uint16_t addr = EESTART;
+  uint16_t addr = blkaddr + EESTART;
   uint16_t i = 0;
  
   // Write data
@@ -71,28 +71,28 @@ void epWriteData(uint8_t cfgdata[], uint16_t cfgsize) {
   }
   // Write CRC
   crc = getCRC16(cfgdata, cfgsize);
-  EEPROM.put(0, crc);
+  EEPROM.put(blkaddr, crc);
   // Commit write to Flash
 }
 
 
 /***** Read data from EEPROM (with CRC check) *****/
 /*
- * addr = EEPROM address
+ * blkaddr = EEPROM address of block (CRC followed by data)
  * cfg = config data union object
  * csize = size of config data object
  */
-bool epReadData(uint8_t cfgdata[], uint16_t cfgsize) {
+bool epReadData(uint8_t cfgdata[], uint16_t cfgsize, uint16_t blkaddr) {
   uint16_t crc1;
   uint16_t crc2;
 //  uint16_t addr = EESTART;
   uint16_t i=0;
 
   // Read CRC
-  EEPROM.get(0,crc1);
+  EEPROM.get(blkaddr,crc1);
   // Read data
   for (i=0;i<cfgsize;i++){
-    cfgdata[i] = EEPROM.read(EESTART+i);
+    cfgdata[i] = EEPROM.read(blkaddr+EESTART+i);
   }
 //  EEPROM.get(addr, cfgdata);
   // Get CRC of config
@@ -118,6 +118,18 @@ bool isEepromClear(){
   }
 }
 
+
+/***** Read a single byte from EEPROM *****/
+uint8_t epReadByte(uint16_t addr) {
+  return EEPROM.read(addr);
+}
+
+
+/***** Write a single byte to EEPROM (only if changed) *****/
+void epWriteByte(uint16_t addr, uint8_t val) {
+  EEPROM.update(addr, val);
+}
+
 #endif
 
 /************************************/
@@ -167,21 +179,23 @@ void epErase() {
 
 /***** Write data to EEPROM (with CRC) *****/
 /*
- * addr = EEPROM address
+ * blkaddr = EEPROM address of block (CRC followed by data)
  * cfg = config data union object
  * csize = size of config data object
  */
-void epWriteData(uint8_t cfgdata[], uint16_t cfgsize) {
+void epWriteData(uint8_t cfgdata[], uint16_t cfgsize, uint16_t blkaddr) {
   uint16_t crc;
-  uint16_t addr = EESTART;
+  uint16_t addr = blkaddr + EESTART;
   
   // Load EEPROM data from Flash
   EEPROM.begin(EESIZE);
   // Write data
-  EEPROM.put(addr,cfgdata);
+  for (uint16_t i=0; i<cfgsize; i++){
+    EEPROM.write(addr+i, cfgdata[i]);
+  }
   // Write CRC
   crc = getCRC16(cfgdata, cfgsize);
-  EEPROM.put(0, crc);
+  EEPROM.put(blkaddr, crc);
   // Commit write to Flash
   EEPROM.commit();
   EEPROM.end();
@@ -190,21 +204,23 @@ void epWriteData(uint8_t cfgdata[], uint16_t cfgsize) {
 
 /***** Read data from EEPROM (with CRC check) *****/
 /*
- * addr = EEPROM address
+ * blkaddr = EEPROM address of block (CRC followed by data)
  * cfg = config data union object
  * csize = size of config data object
  */
-bool epReadData(uint8_t cfgdata[], uint16_t cfgsize) {
+bool epReadData(uint8_t cfgdata[], uint16_t cfgsize, uint16_t blkaddr) {
   uint16_t crc1;
   uint16_t crc2;
-  uint16_t addr = EESTART;
+  uint16_t addr = blkaddr + EESTART;
 
   // Load EEPROM data from Flash
   EEPROM.begin(EESIZE);
   // Read CRC
-  EEPROM.get(0,crc1);
+  EEPROM.get(blkaddr,crc1);
   // Read data
-  EEPROM.get(addr, cfgdata);
+  for (uint16_t i=0; i<cfgsize; i++){
+    cfgdata[i] = EEPROM.read(addr+i);
+  }
   EEPROM.end();
   // Get CRC of config
   crc2 = getCRC16(cfgdata, cfgsize);
@@ -232,6 +248,25 @@ bool isEepromClear(){
   }
 }
 
+
+/***** Read a single byte from EEPROM *****/
+uint8_t epReadByte(uint16_t addr) {
+  uint8_t val;
+  EEPROM.begin(EESIZE);
+  val = EEPROM.read(addr);
+  EEPROM.end();
+  return val;
+}
+
+
+/***** Write a single byte to EEPROM *****/
+void epWriteByte(uint16_t addr, uint8_t val) {
+  EEPROM.begin(EESIZE);
+  EEPROM.write(addr, val);
+  EEPROM.commit();
+  EEPROM.end();
+}
+
 #endif
 
 
@@ -20,6 +20,15 @@
 
 #define EESIZE 256
 #define EESTART 2    // EEPROM start of data - min 4 for CRC32, min 2 for CRC16
+
+/*
+ * EEPROM layout: each block is a CRC16 followed by the data (at block address + EESTART)
+ * 0   - interface configuration
+ * 88  - bus topology map (++busmap)
+ * 224 - macros defined with ++macro def (no CRC, see AR488.ino)
+ */
+#define EE_BUSMAP 88
+#define EE_MACROS 224
 #define UPCASE true
 
 
@@ -62,10 +71,12 @@ template<typename T> void epViewData(T* output) {
 
 
 void epErase();
-void epWriteData(uint8_t cfgdata[], uint16_t cfgsize);
-bool epReadData(uint8_t cfgdata[], uint16_t cfgsize);
+void epWriteData(uint8_t cfgdata[], uint16_t cfgsize, uint16_t blkaddr = 0);
+bool epReadData(uint8_t cfgdata[], uint16_t cfgsize, uint16_t blkaddr = 0);
 void epViewData(Stream& outputStream);
 bool isEepromClear();
+uint8_t epReadByte(uint16_t addr);
+void epWriteByte(uint16_t addr, uint8_t val);
 
 
 #endif // AR488_EEPROM_H
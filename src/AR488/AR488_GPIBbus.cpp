@@ -2,6 +2,7 @@
 //#include <SD.h>
 #include "AR488_Config.h"
 #include "AR488_GPIBbus.h"
+#include "AR488_Trace.h"
 
 /***** AR488_GPIB.cpp, ver. 0.53.04, 13/04/2025 *****/
 
@@ -34,6 +35,78 @@ GPIBbus::GPIBbus() {
   setDefaultCfg();
   cstate = 0;
   deviceAddressed = TONONE;
+  clearStats();
+#ifdef HS_HISTOGRAM
+  hsHist.enabled = false;
+  hsAddr = HS_CTRL;
+  clearHsHist();
+#endif
+}
+
+
+/***** Clear the bus statistics *****/
+void GPIBbus::clearStats() {
+  memset(&stats, 0, sizeof(stats));
+}
+
+
+#ifdef HS_HISTOGRAM
+/***** Clear the handshake histograms and address slots *****/
+void GPIBbus::clearHsHist() {
+  memset(hsHist.addr, HS_CTRL - 1, sizeof(hsHist.addr));
+  memset(hsHist.cnt, 0, sizeof(hsHist.cnt));
+}
+
+
+/***** Histogram slot of the device at the other end of the handshake *****/
+/*
+ * Returns HS_HISTOGRAM when all slots are used by other addresses
+ */
+uint8_t GPIBbus::hsSlot() {
+  uint8_t addr = (cfg.cmode == 2) ? hsAddr : HS_CTRL;
+  uint8_t i;
+
+  for (i = 0; i < HS_HISTOGRAM; i++) {
+    if (hsHist.addr[i] == addr) return i;
+    // Unused slot
+    if (hsHist.addr[i] == (HS_CTRL - 1)) {
+      hsHist.addr[i] = addr;
+      return i;
+    }
+  }
+  return i;
+}
+
+
+/***** Record the time taken by a handshake phase and start the next *****/
+void GPIBbus::hsPhase(uint8_t slot, uint8_t phase, unsigned long &tmark) {
+  unsigned long now = micros();
+  unsigned long elapsed = now - tmark;
+  uint8_t b = 0;
+
+  tmark = now;
+  if (slot >= HS_HISTOGRAM) return;
+  while ((elapsed > 1) && (b < (HS_BUCKETS - 1))) {
+    elapsed >>= 1;
+    b++;
+  }
+  if (hsHist.cnt[slot][phase][b] < 0xFFFF) hsHist.cnt[slot][phase][b]++;
+}
+#endif
+
+
+/***** Count a handshake that did not complete *****/
+void GPIBbus::countHandshake(enum gpibHandshakeStates state) {
+  switch (state) {
+    case IFC_ASSERTED:
+      stats.ifcAborts++;
+      break;
+    case ATN_ASSERTED:
+      stats.atnAborts++;
+      break;
+    default:
+      if (stats.timeouts[state] < 0xFFFF) stats.timeouts[state]++;
+  }
 }
 
 
@@ -370,6 +443,53 @@ bool GPIBbus::sendGET(uint8_t addr) {
 }
 
 
+/***** Send GET (trigger) to a group of devices *****/
+/*
+ * All devices are addressed to listen first and then a single GET
+ * is sent so that every device in the group triggers on the same
+ * handshake. The time (micros) at which GET was placed on the bus
+ * is returned in getTime.
+ */
+bool GPIBbus::sendGroupGET(uint8_t addrs[], uint8_t cnt, unsigned long *getTime) {
+#ifdef DEBUG_GPIB_COMMANDS
+  DB_PRINT(F("sending group GET..."), "");
+#endif
+  // Unlisten and untalk the bus
+  if (sendCmd(GC_UNL)) return ERR;
+  if (sendCmd(GC_UNT)) return ERR;
+  // Address each device in the group to listen
+  for (uint8_t i = 0; i < cnt; i++) {
+    if (addrs[i] > 30) return ERR;
+    if (sendCmd(GC_LAD + addrs[i])) {
+#ifdef DEBUG_GPIB_COMMANDS
+      DB_PRINT(F("failed to address device: "), addrs[i]);
+#endif
+      return ERR;
+    }
+  }
+  deviceAddressed = TOLISTEN;
+  // Send a single GET to all addressed listeners
+  *getTime = micros();
+  if (sendCmd(GC_GET)) {
+#ifdef DEBUG_GPIB_COMMANDS
+    DB_PRINT(F("failed to send GET to group"), "");
+#endif
+    return ERR;
+  }
+  // Unlisten bus
+  if (unAddressDevice()) {
+#ifdef DEBUG_GPIB_COMMANDS
+    DB_PRINT(F("failed to unlisten the GPIB bus"), "");
+#endif
+    return ERR;
+  }
+#ifdef DEBUG_GPIB_COMMANDS
+  DB_PRINT(F("done."), "");
+#endif
+  return OK;
+}
+
+
 /***** Send a TCT (Take Control) command *****/
 bool GPIBbus::sendTCT(uint8_t addr){
  #ifdef DEBUG_GPIB_COMMANDS
@@ -402,6 +522,102 @@ bool GPIBbus::sendTCT(uint8_t addr){
 }
 
 
+/***** Send PPC + PPE (parallel poll enable) to a device *****/
+/*
+ * ppeByte = 0x60 | S<<3 | P where S = sense and P = DIO line (0-7)
+ */
+bool GPIBbus::sendPPE(uint8_t addr, uint8_t ppeByte) {
+#ifdef DEBUG_GPIB_COMMANDS
+  DB_PRINT(F("sending PPE..."), "");
+#endif
+  if ( (ppeByte & 0xF0) != GC_PPE ) return ERR;
+  if (addressDevice(addr, 0xFF, TOLISTEN)) {
+#ifdef DEBUG_GPIB_COMMANDS
+    DB_PRINT(F("failed to address the device."), "");
+#endif
+    return ERR;
+  }
+  // Send PPC followed by the PPE secondary command
+  if (sendCmd(GC_PPC)) return ERR;
+  if (sendCmd(ppeByte)) {
+#ifdef DEBUG_GPIB_COMMANDS
+    DB_PRINT(F("failed to send PPE to device"), "");
+#endif
+    return ERR;
+  }
+  // Unlisten bus
+  if (unAddressDevice()) return ERR;
+#ifdef DEBUG_GPIB_COMMANDS
+  DB_PRINT(F("done."), "");
+#endif
+  return OK;
+}
+
+
+/***** Send PPC + PPD (parallel poll disable) to a device *****/
+bool GPIBbus::sendPPD(uint8_t addr) {
+#ifdef DEBUG_GPIB_COMMANDS
+  DB_PRINT(F("sending PPD..."), "");
+#endif
+  if (addressDevice(addr, 0xFF, TOLISTEN)) {
+#ifdef DEBUG_GPIB_COMMANDS
+    DB_PRINT(F("failed to address the device."), "");
+#endif
+    return ERR;
+  }
+  // Send PPC followed by the PPD secondary command
+  if (sendCmd(GC_PPC)) return ERR;
+  if (sendCmd(GC_PPD)) {
+#ifdef DEBUG_GPIB_COMMANDS
+    DB_PRINT(F("failed to send PPD to device"), "");
+#endif
+    return ERR;
+  }
+  // Unlisten bus
+  if (unAddressDevice()) return ERR;
+#ifdef DEBUG_GPIB_COMMANDS
+  DB_PRINT(F("done."), "");
+#endif
+  return OK;
+}
+
+
+/***** Send PPU (parallel poll unconfigure) to all devices *****/
+bool GPIBbus::sendPPU() {
+  if (sendCmd(GC_PPU)) {
+#ifdef DEBUG_GPIB_COMMANDS
+    DB_PRINT(F("failed to send PPU"), "");
+#endif
+    return ERR;
+  }
+  return OK;
+}
+
+
+/***** Conduct a parallel poll and return the response byte *****/
+uint8_t GPIBbus::parallelPoll() {
+  uint8_t sb = 0;
+
+  // Start in controller idle state
+  setControls(CIDS);
+  delayMicroseconds(20);
+
+  // Assert ATN and EOI
+  setTransmitMode(TM_SEND);
+  assertSignal( ATN_BIT | EOI_BIT );
+  setTransmitMode(TM_RECV);
+  delayMicroseconds(20);
+
+  // Read data byte from GPIB bus without handshake
+  sb = readGpibDbus();
+
+  // Return to controller idle state (ATN and EOI unasserted)
+  setControls(CIDS);
+
+  return sb;
+}
+
+
 /***** Send request to clear to all devices to local *****/
 void GPIBbus::sendAllClear() {
   // Un-assert REN
@@ -501,6 +717,12 @@ bool GPIBbus::sendCmd(uint8_t cmdByte) {
 
   // Set lines for command and assert ATN
   if (cstate != CCMS) setControls(CCMS);
+#ifdef HS_HISTOGRAM
+  // Following data handshakes are with the device addressed here (the
+  // controller's own listen address is sent when polling a talker)
+  if ( ((cmdByte & 0x60) == GC_TAD) && (cmdByte != GC_UNT) ) hsAddr = cmdByte & 0x1F;
+  if ( ((cmdByte & 0x60) == GC_LAD) && (cmdByte != GC_UNL) && ((cmdByte & 0x1F) != cfg.caddr) ) hsAddr = cmdByte & 0x1F;
+#endif
   // Send the command
   state = writeByte(cmdByte, NO_EOI);
   if (state == HANDSHAKE_COMPLETE) return OK;
@@ -779,6 +1001,38 @@ void GPIBbus::sendData(char *data, uint8_t dsize) {
 }
 
 
+/***** Send a block of bytes as data to the GPIB bus *****/
+/*
+ * Bytes are sent as they are without terminators. EOI is asserted
+ * with the last byte when eoiLast is true. Returns the number of bytes
+ * sent, which is less than dsize if the transfer was interrupted by
+ * the controller (ATN/IFC) or the receiver timed out.
+ */
+uint16_t GPIBbus::sendRawData(uint8_t *data, uint16_t dsize, bool eoiLast) {
+  uint16_t i;
+
+  // Set control pins for writing data (ATN unasserted)
+  if (cfg.cmode == 2) {
+    setControls(CTAS);
+  } else {
+    setControls(DTAS);
+  }
+
+  for (i = 0; i < dsize; i++) {
+    if (writeByte(data[i], (eoiLast && (i == (dsize - 1)))) != HANDSHAKE_COMPLETE) break;
+  }
+
+  // Set control lines to idle
+  if (cfg.cmode == 2) {
+    setControls(CIDS);
+  } else {
+    setControls(DIDS);
+  }
+
+  return i;
+}
+
+
 
 /**************************************************/
 /***** FUCTIONS TO READ/WRITE DATA TO STORAGE *****/
@@ -786,6 +1040,40 @@ void GPIBbus::sendData(char *data, uint8_t dsize) {
 
 #ifdef EN_STORAGE
 
+/***** Send the contents of a stream (e.g. a stored file) as data *****/
+/*
+ * Bytes are sent until the stream has no more data available. EOI is
+ * asserted with the last byte when eoiLast is true. Returns the number
+ * of bytes sent.
+ */
+uint32_t GPIBbus::sendStreamData(Stream &dataStream, bool eoiLast) {
+  uint32_t cnt = 0;
+  int db;
+  int nextdb;
+
+  if (cfg.cmode == 2) {
+    setControls(CTAS);
+  } else {
+    setControls(DTAS);
+  }
+
+  db = dataStream.read();
+  while (db >= 0) {
+    // Read ahead to find the last byte
+    nextdb = dataStream.read();
+    if (writeByte((uint8_t)db, (eoiLast && (nextdb < 0))) != HANDSHAKE_COMPLETE) break;
+    cnt++;
+    db = nextdb;
+  }
+
+  if (cfg.cmode == 2) {
+    setControls(CIDS);
+  } else {
+    setControls(DIDS);
+  }
+
+  return cnt;
+}
 
 #endif
 
@@ -811,6 +1099,8 @@ void GPIBbus::signalBreak() {
  */
 void GPIBbus::setControls(uint8_t state) {
 
+  TRACE(TRC_CONTROL, TE_CONTROL, state, 0);
+
   // Switch state
   switch (state) {
 
@@ -974,6 +1264,7 @@ void GPIBbus::setDataVal(uint8_t value) {
 
 /***** Unaddress device *****/
 bool GPIBbus::unAddressDevice() {
+  TRACE(TRC_ADDRESS, TE_UNADDRESS, 0, 0);
   // De-bounce
   delayMicroseconds(30);
   // Utalk/unlisten
@@ -995,6 +1286,8 @@ bool GPIBbus::addressDevice(uint8_t pri, uint8_t sec=0xFF, uint8_t dir=TOLISTEN)
 
   if (pri>30) return ERR;
 
+  TRACE(TRC_ADDRESS, TE_ADDRESS, pri, sec | (dir << 8));
+
   if ( sec<0x60 || (sec>0x7E && sec!=0xFF) ) return ERR;
 
   if (sendCmd(GC_UNL)) return ERR;
@@ -1072,15 +1365,35 @@ void GPIBbus::clearDataBus() {
  * (- the GPIB bus must already be configured to listen )
  */
 enum gpibHandshakeStates GPIBbus::readByte(uint8_t *db, bool readWithEoi, bool *eoi) {
+  return readByte(db, readWithEoi, eoi, cfg.rtmo);
+}
+
+
+/***** Read a byte, waiting at most tmo milliseconds for the talker *****/
+/*
+ * tmo only limits the wait for DAV. Once the talker has placed a byte,
+ * the handshake is completed within the read timeout so that a byte is
+ * never left half accepted. NRFD is left unasserted (ready for data) if
+ * no byte arrives in time, and asserted after a byte until the next
+ * call. A poll (tmo shorter than the read timeout) that finds no data
+ * is not counted as a timeout.
+ */
+enum gpibHandshakeStates GPIBbus::readByte(uint8_t *db, bool readWithEoi, bool *eoi, uint16_t tmo) {
 
   unsigned long startMillis = millis();
   unsigned long currentMillis = startMillis + 1;
-  const unsigned long timeval = cfg.rtmo;
+  unsigned long timeval = tmo;
   enum gpibHandshakeStates gpibState = HANDSHAKE_START;
 
   bool atnStat = isAsserted(ATN_PIN);  // Capture state of ATN
   *eoi = false;
 
+#ifdef HS_HISTOGRAM
+  // Commands (ATN asserted) are accepted by all devices, so not timed
+  uint8_t hslot = (hsHist.enabled && !atnStat) ? hsSlot() : HS_HISTOGRAM;
+  unsigned long hsmark = 0;
+#endif
+
   // Wait for interval to expire
   while ((unsigned long)(currentMillis - startMillis) < timeval) {
 
@@ -1105,6 +1418,9 @@ enum gpibHandshakeStates GPIBbus::readByte(uint8_t *db, bool readWithEoi, bool *
       // Unassert NRFD (we are ready for more data)
       clearSignal(NRFD_BIT);
       gpibState = WAIT_FOR_DATA;
+#ifdef HS_HISTOGRAM
+      if (hslot < HS_HISTOGRAM) hsmark = micros();
+#endif
     }
 
     if (gpibState == WAIT_FOR_DATA) {
@@ -1113,6 +1429,14 @@ enum gpibHandshakeStates GPIBbus::readByte(uint8_t *db, bool readWithEoi, bool *
         // Assert NRFD (Busy reading data)
         assertSignal(NRFD_BIT);
         gpibState = READ_DATA;
+#ifdef HS_HISTOGRAM
+        if (hslot < HS_HISTOGRAM) hsPhase(hslot, 0, hsmark);
+#endif
+        // Short poll: allow the full read timeout to finish the handshake
+        if (tmo < cfg.rtmo) {
+          startMillis = millis();
+          timeval = cfg.rtmo;
+        }
       }
     }
 
@@ -1124,6 +1448,9 @@ enum gpibHandshakeStates GPIBbus::readByte(uint8_t *db, bool readWithEoi, bool *
       // Unassert NDAC signalling data accepted
       clearSignal(NDAC_BIT);
       gpibState = DATA_ACCEPTED;
+#ifdef HS_HISTOGRAM
+      if (hslot < HS_HISTOGRAM) hsPhase(hslot, 1, hsmark);
+#endif
     }
 
     if (gpibState == DATA_ACCEPTED) {
@@ -1132,6 +1459,9 @@ enum gpibHandshakeStates GPIBbus::readByte(uint8_t *db, bool readWithEoi, bool *
         // Re-assert NDAC - handshake complete, ready to accept data again
         assertSignal(NDAC_BIT);
         gpibState = HANDSHAKE_COMPLETE;
+#ifdef HS_HISTOGRAM
+        if (hslot < HS_HISTOGRAM) hsPhase(hslot, 2, hsmark);
+#endif
         break;
       }
     }
@@ -1140,6 +1470,14 @@ enum gpibHandshakeStates GPIBbus::readByte(uint8_t *db, bool readWithEoi, bool *
     currentMillis = millis();
   }
 
+  if (gpibState == HANDSHAKE_COMPLETE) {
+    stats.rxBytes++;
+    TRACE(TRC_RECEIVE, TE_RX_BYTE, *db, (*eoi ? 0x01 : 0) | (atnStat ? 0x02 : 0));
+  }else if ( (gpibState != WAIT_FOR_DATA) || (tmo >= cfg.rtmo) ) {
+    countHandshake(gpibState);
+    TRACE(TRC_RECEIVE, TE_RX_FAIL, gpibState, 0);
+  }
+
   // Otherwise return stage
 #ifdef DEBUG_GPIBbus_RECEIVE
   if ((gpibState == HANDSHAKE_STARTED) || (gpibState == UNASSERTED_NDAC)) {
@@ -1159,6 +1497,12 @@ enum gpibHandshakeStates GPIBbus::writeByte(uint8_t db, bool isLastByte) {
   const unsigned long timeval = cfg.rtmo;
   enum gpibHandshakeStates gpibState = HANDSHAKE_START;
 
+#ifdef HS_HISTOGRAM
+  // Commands (ATN asserted) are accepted by all devices, so not timed
+  uint8_t hslot = (hsHist.enabled && !isAsserted(ATN_PIN)) ? hsSlot() : HS_HISTOGRAM;
+  unsigned long hsmark = (hslot < HS_HISTOGRAM) ? micros() : 0;
+#endif
+
   // Wait for interval to expire
   while ((unsigned long)(currentMillis - startMillis) < timeval) {
 
@@ -1191,14 +1535,19 @@ enum gpibHandshakeStates GPIBbus::writeByte(uint8_t db, bool isLastByte) {
 
     // Wait for NRFD to go HIGH (indicating that receiver is ready)
     if (gpibState == WAIT_FOR_RECEIVER_READY) {
-      if (getGpibPinState(NRFD_PIN) == HIGH) gpibState = PLACE_DATA;
+      if (getGpibPinState(NRFD_PIN) == HIGH) {
+        gpibState = PLACE_DATA;
+#ifdef HS_HISTOGRAM
+        if (hslot < HS_HISTOGRAM) hsPhase(hslot, 3, hsmark);
+#endif
+      }
     }
 
     if (gpibState == PLACE_DATA) {
       // Place data on the bus
       setGpibDbus(db);
-      if (cfg.eoi && isLastByte) {
-        // If EOI enabled and this is the last byte then assert DAV and EOI
+      if (isLastByte) {
+        // If this is the last byte then assert DAV and EOI
 #ifdef DEBUG_GPIBbus_SEND
         DB_PRINT(F("Asserting EOI..."), "");
 #endif
@@ -1212,13 +1561,21 @@ enum gpibHandshakeStates GPIBbus::writeByte(uint8_t db, bool isLastByte) {
 
     if (gpibState == DATA_READY) {
       // Wait for NRFD to go LOW (receiver accepting data)
-      if (getGpibPinState(NRFD_PIN) == LOW) gpibState = RECEIVER_ACCEPTING;
+      if (getGpibPinState(NRFD_PIN) == LOW) {
+        gpibState = RECEIVER_ACCEPTING;
+#ifdef HS_HISTOGRAM
+        if (hslot < HS_HISTOGRAM) hsPhase(hslot, 4, hsmark);
+#endif
+      }
     }
 
     if (gpibState == RECEIVER_ACCEPTING) {
       // Wait for NDAC to go HIGH (data accepted)
       if (getGpibPinState(NDAC_PIN) == HIGH) {
         gpibState = HANDSHAKE_COMPLETE;
+#ifdef HS_HISTOGRAM
+        if (hslot < HS_HISTOGRAM) hsPhase(hslot, 5, hsmark);
+#endif
         break;
       }
     }
@@ -1229,8 +1586,8 @@ enum gpibHandshakeStates GPIBbus::writeByte(uint8_t db, bool isLastByte) {
 
   // Handshake complete
   if (gpibState == HANDSHAKE_COMPLETE) {
-    if (cfg.eoi && isLastByte) {
-      // If EOI enabled and this is the last byte then un-assert both DAV and EOI
+    if (isLastByte) {
+      // If this is the last byte then un-assert both DAV and EOI
       clearSignal(DAV_BIT | EOI_BIT);
     } else {
       // Unassert DAV
@@ -1238,9 +1595,14 @@ enum gpibHandshakeStates GPIBbus::writeByte(uint8_t db, bool isLastByte) {
     }
     // Reset the data bus
     setGpibDbus(0);
+    stats.txBytes++;
+    TRACE(TRC_SEND, TE_TX_BYTE, db, (isLastByte ? 0x01 : 0) | (isAsserted(ATN_PIN) ? 0x02 : 0));
     return gpibState;
   }
 
+  countHandshake(gpibState);
+  TRACE(TRC_SEND, TE_TX_FAIL, gpibState, db | (isAsserted(ATN_PIN) ? 0x100 : 0));
+
   // Otherwise timeout or ATN/IFC return stage at which it ocurred
 #ifdef DEBUG_GPIBbus_SEND
   switch (gpibState) {
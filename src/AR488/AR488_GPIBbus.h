@@ -94,6 +94,36 @@ enum gpibHandshakeStates {
 };
 
 
+/***** Bus statistics (++stats) *****/
+struct GPIBstats {
+  uint32_t rxBytes;
+  uint32_t txBytes;
+  uint16_t timeouts[RECEIVER_ACCEPTING + 1];  // Handshake timeouts by the phase reached
+  uint16_t ifcAborts;
+  uint16_t atnAborts;
+};
+
+
+#ifdef HS_HISTOGRAM
+/***** Handshake phase latency histograms (++hshist) *****/
+/*
+ * Phases: 0 WAIT_FOR_DATA, 1 READ_DATA, 2 DATA_ACCEPTED (reading)
+ *         3 WAIT_FOR_RECEIVER_READY, 4 DATA_READY, 5 RECEIVER_ACCEPTING (writing)
+ * Bucket n counts phases that took 2^n to 2^(n+1)-1 us (bucket 0 from
+ * 0 us, the last bucket has no upper limit).
+ */
+#define HS_PHASES 6
+#define HS_BUCKETS 12
+#define HS_CTRL 0xFF    // Address slot used for the controller in device mode
+
+struct GPIBhsHist {
+  bool enabled;
+  uint8_t addr[HS_HISTOGRAM];
+  uint16_t cnt[HS_HISTOGRAM][HS_PHASES][HS_BUCKETS];
+};
+#endif
+
+
 #define IFC_BIT (1 << 0)
 #define NDAC_BIT (1 << 1)
 #define NRFD_BIT (1 << 2)
@@ -186,10 +216,16 @@ public:
   bool sendLLO();
   bool sendGTL();
   bool sendGET(uint8_t addr);
+  bool sendGroupGET(uint8_t addrs[], uint8_t cnt, unsigned long *getTime);
   bool sendSDC();
   bool sendTCT(uint8_t addr);
   void sendAllClear();
 
+  bool sendPPE(uint8_t addr, uint8_t ppeByte);
+  bool sendPPD(uint8_t addr);
+  bool sendPPU();
+  uint8_t parallelPoll();
+
   bool sendUNT();
   bool sendUNL();
   bool sendMTA();
@@ -204,9 +240,14 @@ public:
   bool sendCmd(uint8_t cmdByte);
   bool sendSecondaryCmd(uint8_t paddr, uint8_t saddr, char * data, uint8_t dsize);
   enum gpibHandshakeStates readByte(uint8_t *db, bool readWithEoi, bool *eoi);
+  enum gpibHandshakeStates readByte(uint8_t *db, bool readWithEoi, bool *eoi, uint16_t tmo);
   enum gpibHandshakeStates writeByte(uint8_t db, bool isLastByte);
   bool receiveData(Stream &dataStream, bool detectEoi, bool detectEndByte, uint8_t endByte);
   void sendData(char *data, uint8_t dsize);
+  uint16_t sendRawData(uint8_t *data, uint16_t dsize, bool eoiLast);
+#ifdef EN_STORAGE
+  uint32_t sendStreamData(Stream &dataStream, bool eoiLast);
+#endif
   void clearDataBus();
   void setControlVal(uint8_t value);
   void setDataVal(uint8_t value);
@@ -221,11 +262,25 @@ public:
   bool unAddressDevice();
   bool haveAddressedDevice();
 
+  GPIBstats stats;
+  void clearStats();
+
+#ifdef HS_HISTOGRAM
+  GPIBhsHist hsHist;
+  void clearHsHist();
+#endif
+
 private:
 
   bool txBreak;  // Signal to break the GPIB transmission
   uint8_t deviceAddressed;
   bool isTerminatorDetected(uint8_t bytes[3], uint8_t eorSequence);
+  void countHandshake(enum gpibHandshakeStates state);
+#ifdef HS_HISTOGRAM
+  uint8_t hsAddr;   // Primary address of the device last addressed (set by sendCmd)
+  uint8_t hsSlot();
+  void hsPhase(uint8_t slot, uint8_t phase, unsigned long &tmark);
+#endif
 
   // Interrupt flag for MCP23S17
 #ifdef AR488_MCP23S17
@@ -0,0 +1,269 @@
+#include <Arduino.h>
+#include "AR488_Config.h"
+#include "AR488_Storage.h"
+
+/***** AR488_Storage.cpp, ver. 0.00.01, 19/10/2026 *****/
+/*
+ * SD card storage of bus data implementation
+ */
+
+#ifdef EN_STORAGE
+
+#ifdef ESP32
+  #define STORAGE_APPEND FILE_APPEND
+#else
+  #define STORAGE_APPEND FILE_WRITE
+#endif
+
+// The card must not share pins with the bus
+#ifdef AR488_MCP23S17
+static_assert((STORAGE_CS_PIN != MCP_SELECTPIN) && (STORAGE_CS_PIN != MCP_INTERRUPT),
+              "STORAGE_CS_PIN is used by the MCP23S17");
+#else
+#define STORAGE_PIN_FREE(pin) ( ((pin) != DIO1_PIN) && ((pin) != DIO2_PIN) && ((pin) != DIO3_PIN) && \
+                                ((pin) != DIO4_PIN) && ((pin) != DIO5_PIN) && ((pin) != DIO6_PIN) && \
+                                ((pin) != DIO7_PIN) && ((pin) != DIO8_PIN) && ((pin) != IFC_PIN) && \
+                                ((pin) != NDAC_PIN) && ((pin) != NRFD_PIN) && ((pin) != DAV_PIN) && \
+                                ((pin) != EOI_PIN) && ((pin) != SRQ_PIN) && ((pin) != REN_PIN) && \
+                                ((pin) != ATN_PIN) )
+static_assert(STORAGE_PIN_FREE(STORAGE_CS_PIN), "STORAGE_CS_PIN is a GPIB pin");
+static_assert(STORAGE_PIN_FREE(MOSI) && STORAGE_PIN_FREE(MISO) && STORAGE_PIN_FREE(SCK),
+              "The SPI pins used by the SD card are GPIB pins");
+#endif
+
+
+AR488storage::AR488storage()
+{
+  _bus = NULL;
+  _ready = false;
+  _open = false;
+  _failed = false;
+  _fnum = 0;
+  _blen = 0;
+  _bytes = 0;
+  _blocks = 0;
+}
+
+
+/***** Initialise the SD card *****/
+bool AR488storage::begin(GPIBbus &bus)
+{
+  _bus = &bus;
+  _ready = SD.begin(STORAGE_CS_PIN);
+  return _ready;
+}
+
+
+int AR488storage::available()
+{
+  return 0;
+}
+
+int AR488storage::peek()
+{
+  return EOF;
+}
+
+int AR488storage::read()
+{
+  return EOF;
+}
+
+
+/***** Write any buffered data to the card *****/
+void AR488storage::flush()
+{
+  if (!_open) return;
+  writeBlock();
+  _file.flush();
+}
+
+
+/***** Append a byte to the open file *****/
+size_t AR488storage::write(const uint8_t data)
+{
+  if (!_open) return 0;
+  _buf[_blen++] = data;
+  _bytes++;
+  if (_blen == STORAGE_BLOCK) writeBlock();
+  return 1;
+}
+
+
+void AR488storage::writeBlock()
+{
+  if (!_blen) return;
+  if (_file.write(_buf, _blen) != _blen) _failed = true;
+  _blen = 0;
+  _blocks++;
+}
+
+
+void AR488storage::fileName(uint8_t fnum, char *fname)
+{
+  sprintf(fname, "/GPIB%02u.DAT", fnum);
+}
+
+
+/***** Open a file for appending (closes any file already open) *****/
+bool AR488storage::open(uint8_t fnum)
+{
+  char fname[STORAGE_FNLEN];
+
+  close();
+  if (!_ready) return false;
+  fileName(fnum, fname);
+  _file = SD.open(fname, STORAGE_APPEND);
+  if (!_file) return false;
+  _open = true;
+  _failed = false;
+  _fnum = fnum;
+  _bytes = 0;
+  _blocks = 0;
+  return true;
+}
+
+
+void AR488storage::close()
+{
+  if (!_open) return;
+  writeBlock();
+  _file.close();
+  _open = false;
+}
+
+
+bool AR488storage::erase(uint8_t fnum)
+{
+  char fname[STORAGE_FNLEN];
+
+  if (!_ready) return false;
+  if (_open && (fnum == _fnum)) close();
+  fileName(fnum, fname);
+  if (!SD.exists(fname)) return true;
+  return SD.remove(fname);
+}
+
+
+/***** List the files in use and their sizes *****/
+/*
+ * The size of the open file includes the data still in the RAM block,
+ * which is not written to the card by listing.
+ */
+void AR488storage::list(Stream &outputStream)
+{
+  char fname[STORAGE_FNLEN];
+  File file;
+  uint32_t size;
+
+  if (!_ready) return;
+  for (uint8_t i = 0; i < 32; i++) {
+    fileName(i, fname);
+    if (!SD.exists(fname)) continue;
+    file = SD.open(fname, FILE_READ);
+    if (!file) continue;
+    size = file.size();
+    if (_open && (i == _fnum)) size += _blen;
+    outputStream.print(i);
+    outputStream.print(',');
+    outputStream.println(size);
+    file.close();
+  }
+}
+
+
+/***** Send the contents of a file to a stream *****/
+uint32_t AR488storage::dump(uint8_t fnum, Stream &outputStream)
+{
+  char fname[STORAGE_FNLEN];
+  File file;
+  uint32_t cnt = 0;
+  int16_t len;
+
+  if (!_ready) return 0;
+  if (_open && (fnum == _fnum)) flush();
+  fileName(fnum, fname);
+  file = SD.open(fname, FILE_READ);
+  if (!file) return 0;
+  // Re-use the block buffer when no file is being written
+  if (!_open) {
+    while ((len = file.read(_buf, STORAGE_BLOCK)) > 0) {
+      outputStream.write(_buf, len);
+      cnt += len;
+    }
+  }else{
+    while (file.available()) {
+      outputStream.write((uint8_t)file.read());
+      cnt++;
+    }
+  }
+  file.close();
+  return cnt;
+}
+
+
+/***** Execute a GPIB secondary address command *****/
+/*
+ * Addressed to listen: the data that follows is appended to the file
+ * numbered by the secondary address. Addressed to talk: the file is
+ * sent. Any file opened with ++store is closed first.
+ */
+void AR488storage::storeExecCmd(uint8_t saddrcmd)
+{
+  char fname[STORAGE_FNLEN];
+  File file;
+  uint8_t fnum = saddrcmd & 0x1F;
+
+  if (!_bus) return;
+
+  if (_bus->isDeviceAddressedToListen()) {
+    if (open(fnum)) {
+      _bus->receiveData(*this, false, false, 0x0);
+      close();
+    }
+  }else if (_bus->isDeviceAddressedToTalk()) {
+    close();
+    fileName(fnum, fname);
+    if (_ready) file = SD.open(fname, FILE_READ);
+    if (file) {
+      _bus->sendStreamData(file, true);
+      file.close();
+    }
+  }
+
+  _bus->setControls(DIDS);
+}
+
+
+bool AR488storage::isReady()
+{
+  return _ready;
+}
+
+bool AR488storage::isOpen()
+{
+  return _open;
+}
+
+uint8_t AR488storage::fileNum()
+{
+  return _fnum;
+}
+
+uint32_t AR488storage::bytesStored()
+{
+  return _bytes;
+}
+
+uint32_t AR488storage::blocksWritten()
+{
+  return _blocks;
+}
+
+bool AR488storage::writeFailed()
+{
+  return _failed;
+}
+
+
+#endif  // EN_STORAGE
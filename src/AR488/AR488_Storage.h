@@ -0,0 +1,81 @@
+#ifndef AR488_STORAGE_H
+#define AR488_STORAGE_H
+
+#include "AR488_Config.h"
+#include "AR488_GPIBbus.h"
+
+#ifdef EN_STORAGE
+#include <SD.h>
+
+#ifndef STORAGE_CS_PIN
+  #error "EN_STORAGE: STORAGE_CS_PIN must be defined for this board layout"
+#endif
+
+// Size of a file name buffer ("/GPIBnn.DAT")
+#define STORAGE_FNLEN 13
+
+/***** AR488_Storage.h, ver. 0.00.01, 19/10/2026 *****/
+
+/*
+ * Append-only storage of bus data on an SD card (SPI).
+ *
+ * Data written to the storage stream is collected in a RAM block of
+ * STORAGE_BLOCK bytes and written to the open file a block at a time,
+ * so the bus can be read at full speed without passing each byte
+ * through the serial port or the SD library. Files are numbered 0-31
+ * (GPIBnn.DAT), matching the GPIB secondary addresses:
+ *
+ * MLA + SAD n: data received from the controller is appended to file n
+ * MTA + SAD n: file n is sent to the controller (EOI on the last byte)
+ *
+ * File names start with '/' as required by the ESP32 file system, which
+ * also needs FILE_APPEND rather than FILE_WRITE (truncate) to append.
+ */
+
+class AR488storage : public Stream
+{
+public:
+  AR488storage();
+
+  bool   begin(GPIBbus &bus);
+
+  int    available();
+  int    peek();
+  int    read();
+  void   flush();
+
+  size_t write(const uint8_t data);
+
+  bool   open(uint8_t fnum);
+  void   close();
+  bool   erase(uint8_t fnum);
+  void   list(Stream &outputStream);
+  uint32_t dump(uint8_t fnum, Stream &outputStream);
+
+  void   storeExecCmd(uint8_t saddrcmd);
+
+  bool   isReady();
+  bool   isOpen();
+  uint8_t  fileNum();
+  uint32_t bytesStored();
+  uint32_t blocksWritten();
+  bool   writeFailed();
+
+private:
+  GPIBbus *_bus;
+  File     _file;
+  bool     _ready;
+  bool     _open;
+  bool     _failed;
+  uint8_t  _fnum;
+  uint8_t  _buf[STORAGE_BLOCK];
+  uint16_t _blen;
+  uint32_t _bytes;
+  uint32_t _blocks;
+  void     fileName(uint8_t fnum, char *fname);
+  void     writeBlock();
+};
+
+#endif  // EN_STORAGE
+
+#endif  // AR488_STORAGE_H
@@ -0,0 +1,82 @@
+#include <Arduino.h>
+#include "AR488_Config.h"
+#include "AR488_Trace.h"
+
+/***** AR488_Trace.cpp, ver. 0.00.01, 19/10/2026 *****/
+/*
+ * Binary event trace implementation
+ */
+
+#ifdef TRACE_RING
+
+uint8_t traceMask = 0;
+
+static traceRec traceBuf[TRACE_RING];
+static uint16_t traceHead = 0;
+static uint16_t traceCnt = 0;
+static uint16_t traceLostCnt = 0;
+
+
+/***** Add an event record (overwrites the oldest when full) *****/
+void traceAdd(uint8_t event, uint8_t arg1, uint16_t arg2) {
+  traceRec *rec = &traceBuf[traceHead];
+
+  rec->tstamp = micros();
+  rec->event = event;
+  rec->arg1 = arg1;
+  rec->arg2 = arg2;
+  traceHead = (traceHead + 1) % TRACE_RING;
+  if (traceCnt < TRACE_RING) {
+    traceCnt++;
+  }else if (traceLostCnt < 0xFFFF) {
+    traceLostCnt++;
+  }
+}
+
+
+void traceClear() {
+  traceHead = 0;
+  traceCnt = 0;
+  traceLostCnt = 0;
+}
+
+
+uint16_t traceCount() {
+  return traceCnt;
+}
+
+
+uint16_t traceLost() {
+  return traceLostCnt;
+}
+
+
+/***** Write a little endian value *****/
+static void traceWriteLE(Stream &outputStream, uint32_t val, uint8_t size) {
+  for (uint8_t i = 0; i < size; i++) {
+    outputStream.write((uint8_t)(val & 0xFF));
+    val >>= 8;
+  }
+}
+
+
+/***** Send the trace in binary form (oldest record first) *****/
+void traceDump(Stream &outputStream) {
+  uint16_t idx = (traceHead + TRACE_RING - traceCnt) % TRACE_RING;
+  traceRec *rec;
+
+  outputStream.print(F("ARTR"));
+  outputStream.write((uint8_t)1);
+  traceWriteLE(outputStream, traceCnt, 2);
+  traceWriteLE(outputStream, traceLostCnt, 2);
+  for (uint16_t i = 0; i < traceCnt; i++) {
+    rec = &traceBuf[idx];
+    traceWriteLE(outputStream, rec->tstamp, 4);
+    outputStream.write(rec->event);
+    outputStream.write(rec->arg1);
+    traceWriteLE(outputStream, rec->arg2, 2);
+    idx = (idx + 1) % TRACE_RING;
+  }
+}
+
+#endif  // TRACE_RING
@@ -0,0 +1,72 @@
+#ifndef AR488_TRACE_H
+#define AR488_TRACE_H
+
+#include <Arduino.h>
+#include "AR488_Config.h"
+
+/***** AR488_Trace.h, ver. 0.00.01, 19/10/2026 *****/
+
+/*
+ * Binary event trace.
+ *
+ * Events are written as fixed size records to a RAM ring buffer with a
+ * microsecond timestamp, for the categories enabled at runtime with
+ * ++trace mask. Unlike the DEBUG_* options, nothing is printed while
+ * tracing so bus timing is barely affected. The ring is read with
+ * ++trace dump and decoded with src/tools/ar488_tracedecode.py.
+ *
+ * Dump: "ARTR", version (1), records (uint16), records lost (uint16),
+ * then records of tstamp (uint32), event, arg1 (uint8), arg2 (uint16),
+ * all little endian, oldest first.
+ */
+
+/***** Categories (bits of the trace mask) *****/
+#define TRC_RECEIVE  0x01   // Bytes read from the bus (readByte)
+#define TRC_SEND     0x02   // Bytes written to the bus (writeByte)
+#define TRC_CONTROL  0x04   // Bus control states (setControls)
+#define TRC_DEVICE   0x08   // Device mode ATN processing (attnRequired)
+#define TRC_ADDRESS  0x10   // Addressing of devices by the controller
+#define TRC_COMMAND  0x20   // ++ commands executed
+#define TRC_SERIAL   0x40   // Lines received from the host
+
+/***** Events *****/
+#define TE_RX_BYTE   1      // arg1 = byte, arg2 = bit 0 EOI, bit 1 ATN
+#define TE_RX_FAIL   2      // arg1 = gpibHandshakeStates value reached
+#define TE_TX_BYTE   3      // arg1 = byte, arg2 = bit 0 EOI, bit 1 ATN
+#define TE_TX_FAIL   4      // arg1 = gpibHandshakeStates value reached, arg2 = byte | ATN << 8
+#define TE_CONTROL   5      // arg1 = control state (CINI...DTAS)
+#define TE_ATN_DONE  6      // arg1 = ATN status flags, arg2 = GPIB command or secondary address
+#define TE_ADDRESS   7      // arg1 = primary address, arg2 = secondary address | direction << 8
+#define TE_UNADDRESS 8
+#define TE_COMMAND   9      // arg1 = index of the command in the command table
+#define TE_LINE      10     // arg1 = line type (1 command, 2 data), arg2 = length
+#define TE_MARK      11     // arg1 = mark number (++trace mark n)
+
+
+#ifdef TRACE_RING
+
+struct traceRec {
+  uint32_t tstamp;
+  uint8_t event;
+  uint8_t arg1;
+  uint16_t arg2;
+};
+
+extern uint8_t traceMask;
+
+void traceAdd(uint8_t event, uint8_t arg1, uint16_t arg2);
+void traceClear();
+uint16_t traceCount();
+uint16_t traceLost();
+void traceDump(Stream &outputStream);
+
+// Only the mask test is done when the category is not enabled
+#define TRACE(cat, event, arg1, arg2) do { if (traceMask & (cat)) traceAdd((event), (arg1), (arg2)); } while (0)
+
+#else
+
+#define TRACE(cat, event, arg1, arg2) do {} while (0)
+
+#endif  // TRACE_RING
+
+#endif  // AR488_TRACE_H
@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+"""
+AR488 binary readings decoder
+
+Decodes the frames sent by the interface when readings are converted
+to binary with '++binout' and prints one reading per line.
+
+Frame: 0xB0 + format, count, count x 4 byte little endian values
+  format 1 = float, format 2 = fixed point integer (value x 10^decimals)
+
+Usage:
+  ar488_binread.py [--decimals n] capture.bin    ('-' for stdin)
+"""
+
+import argparse
+import math
+import struct
+import sys
+
+FMT_FLOAT = 1
+FMT_FIXED = 2
+FIXED_INVALID = -2**31
+
+
+def frames(blob):
+    """Yields (format, values) for each frame, skipping anything that is not a frame"""
+    pos = 0
+    while pos + 2 <= len(blob):
+        fmt = blob[pos] - 0xB0
+        count = blob[pos + 1]
+        end = pos + 2 + count * 4
+        if fmt not in (FMT_FLOAT, FMT_FIXED) or count == 0 or end > len(blob):
+            pos += 1
+            continue
+        code = '<%d%s' % (count, 'f' if fmt == FMT_FLOAT else 'i')
+        yield fmt, struct.unpack_from(code, blob, pos + 2)
+        pos = end
+
+
+def main():
+    ap = argparse.ArgumentParser(description='Decode AR488 ++binout frames')
+    ap.add_argument('file', help="file holding the frames ('-' for stdin)")
+    ap.add_argument('--decimals', type=int, default=0,
+                    help='decimals given with ++binout 2 (fixed point)')
+    args = ap.parse_args()
+
+    if args.file == '-':
+        blob = sys.stdin.buffer.read()
+    else:
+        with open(args.file, 'rb') as f:
+            blob = f.read()
+
+    for fmt, values in frames(blob):
+        for val in values:
+            if fmt == FMT_FIXED:
+                print('nan' if val == FIXED_INVALID else val / 10 ** args.decimals)
+            else:
+                print('nan' if math.isnan(val) else repr(val))
+
+
+if __name__ == '__main__':
+    main()
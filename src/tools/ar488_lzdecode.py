@@ -0,0 +1,302 @@
+#!/usr/bin/env python3
+"""
+AR488 compressed output decoder and benchmark
+
+Decodes the output sent by the interface while compression is enabled
+with '++lz 1' (firmware compiled with LZ_WINDOW). Compressed blocks are
+expanded and anything sent outside a block (replies to other commands)
+is passed through unchanged.
+
+Block: 0xCC, then groups of a control byte followed by up to 8 items.
+Bit n (LSB first) of the control byte set means item n is a match:
+distance (1 byte), length - 3 (1 byte). Otherwise item n is a literal.
+A match with distance 0 (single byte) ends the block. Match distances
+refer to the data of earlier blocks only, as the firmware does not see
+the plain text sent between blocks.
+
+Usage:
+  ar488_lzdecode.py capture.bin > output.txt     ('-' for stdin)
+  ar488_lzdecode.py --bench [--window 128] [--baud 9600] [--block-size n] trace.txt ...
+  ar488_lzdecode.py --test
+
+--bench compresses captured instrument output with the same algorithm
+as the firmware (one block per line, as for one reading per response,
+or blocks of --block-size bytes),
+checks that it decodes back to the original and reports the ratio, the
+throughput of this script and the time needed to send the data over a
+link of the given speed with and without compression.
+
+--test checks the decoder against the encoder, including plain text
+between blocks.
+"""
+
+import argparse
+import sys
+import time
+
+LZ_BLOCK = 0xCC
+LZ_MINMATCH = 3
+LZ_MAXLEN = 255 + LZ_MINMATCH
+
+
+def decode(blob, out, hist=None):
+    """Expands the compressed blocks in blob into the bytearray out
+
+    hist holds the block data seen so far (the match history). Pass the
+    same bytearray when a capture is decoded in several parts.
+    """
+    if hist is None:
+        hist = bytearray()
+    pos = 0
+    size = len(blob)
+    while pos < size:
+        if blob[pos] != LZ_BLOCK:
+            # Plain text is not part of the history
+            out.append(blob[pos])
+            pos += 1
+            continue
+        pos += 1
+        ended = False
+        while not ended:
+            if pos >= size:
+                raise ValueError('block truncated')
+            ctrl = blob[pos]
+            pos += 1
+            for bit in range(8):
+                if pos >= size:
+                    raise ValueError('block truncated')
+                if not ctrl & (1 << bit):
+                    out.append(blob[pos])
+                    hist.append(blob[pos])
+                    pos += 1
+                    continue
+                dist = blob[pos]
+                if dist == 0:
+                    pos += 1
+                    ended = True
+                    break
+                if pos + 1 >= size:
+                    raise ValueError('block truncated')
+                length = blob[pos + 1] + LZ_MINMATCH
+                pos += 2
+                if dist > len(hist):
+                    raise ValueError('match distance beyond start of data')
+                start = len(hist) - dist
+                # Byte by byte as the match may overlap the data it produces
+                for k in range(length):
+                    hist.append(hist[start + k])
+                out.extend(hist[-length:])
+            # Only the last 255 bytes can be referred to
+            if len(hist) > 4096:
+                del hist[:-255]
+    return out
+
+
+class Encoder:
+    """Same algorithm as LZSTREAM in AR488_ComPorts.cpp"""
+
+    def __init__(self, window):
+        self.window = window
+        self.hist = bytearray()
+        self.mdist = 0
+        self.mlen = 0
+        self.group = []
+        self.out = bytearray()
+        self.in_block = False
+
+    def hist_at(self, back):
+        return self.hist[-back]
+
+    def add_hist(self, data):
+        self.hist.append(data)
+        if len(self.hist) > self.window:
+            del self.hist[0]
+
+    def put_item(self, item):
+        self.group.append(item)
+        if len(self.group) == 8:
+            self.send_group()
+
+    def send_group(self):
+        if not self.group:
+            return
+        ctrl = 0
+        body = bytearray()
+        for n, item in enumerate(self.group):
+            if isinstance(item, tuple):
+                ctrl |= 1 << n
+                body.extend(item)
+            else:
+                body.append(item)
+        self.out.append(ctrl)
+        self.out.extend(body)
+        self.group = []
+
+    def end_match(self):
+        if self.mlen >= LZ_MINMATCH:
+            self.put_item((self.mdist, self.mlen - LZ_MINMATCH))
+        else:
+            for k in range(self.mlen, 0, -1):
+                self.put_item(self.hist_at(k))
+        self.mlen = 0
+
+    def write(self, data):
+        for byte in data:
+            self.write_byte(byte)
+
+    def write_byte(self, byte):
+        hcnt = len(self.hist)
+        dmax = min(hcnt, 255)
+        if not self.in_block:
+            self.out.append(LZ_BLOCK)
+            self.in_block = True
+        if self.mlen:
+            found = False
+            if self.mlen < LZ_MAXLEN:
+                if self.hist_at(self.mdist) == byte:
+                    found = True
+                else:
+                    d = self.mdist + 1
+                    while d <= dmax and d + self.mlen <= hcnt:
+                        if self.hist_at(d) == byte and all(
+                                self.hist_at(k) == self.hist_at(k + d) for k in range(1, self.mlen + 1)):
+                            self.mdist = d
+                            found = True
+                            break
+                        d += 1
+            # Too short for a match: send the oldest pending byte as a
+            # literal and look for a match starting at the next one
+            while not found and 0 < self.mlen < LZ_MINMATCH:
+                self.put_item(self.hist_at(self.mlen))
+                self.mlen -= 1
+                d = 1
+                while d <= dmax and d + self.mlen <= hcnt:
+                    if self.hist_at(d) == byte and all(
+                            self.hist_at(k) == self.hist_at(k + d) for k in range(1, self.mlen + 1)):
+                        self.mdist = d
+                        found = True
+                        break
+                    d += 1
+            if found:
+                self.mlen += 1
+                self.add_hist(byte)
+                return
+            self.end_match()
+        for d in range(1, dmax + 1):
+            if self.hist_at(d) == byte:
+                self.mdist = d
+                self.mlen = 1
+                break
+        else:
+            self.put_item(byte)
+        self.add_hist(byte)
+
+    def end_block(self):
+        if not self.in_block:
+            return
+        self.end_match()
+        self.put_item((0,))
+        self.send_group()
+        self.in_block = False
+
+
+def blocks(raw, block_size):
+    """Splits data as the interface would: one block per line (response) or fixed size blocks"""
+    if not block_size:
+        return raw.splitlines(keepends=True)
+    return [raw[i:i + block_size] for i in range(0, len(raw), block_size)]
+
+
+def bench(files, window, baud, block_size):
+    for name in files:
+        with open(name, 'rb') as f:
+            raw = f.read()
+        enc = Encoder(window)
+        t0 = time.perf_counter()
+        for block in blocks(raw, block_size):
+            enc.write(block)
+            enc.end_block()
+        t1 = time.perf_counter()
+        dec = decode(bytes(enc.out), bytearray())
+        t2 = time.perf_counter()
+        if dec != raw:
+            sys.exit('ar488_lzdecode: %s does not decode back to the original' % name)
+        size_in = len(raw)
+        size_out = len(enc.out)
+        print('%s: %d -> %d bytes, ratio %.2f (%.1f%%)'
+              % (name, size_in, size_out, size_in / max(size_out, 1), 100.0 * size_out / max(size_in, 1)))
+        print('  script: compress %.0f kB/s, decompress %.0f kB/s'
+              % (size_in / 1e3 / max(t1 - t0, 1e-9), size_in / 1e3 / max(t2 - t1, 1e-9)))
+        print('  at %d baud: %.2f s raw, %.2f s compressed'
+              % (baud, size_in * 10.0 / baud, size_out * 10.0 / baud))
+
+
+def selftest():
+    """Decodes encoder output with replies to other commands between the blocks"""
+    window = 128
+    replies = [b'', b'0,100,90\r\n', b'1\n', b'@5 ']
+    readings = [b'+1.234567E+00\r\n', b'+1.234568E+00\r\n', b'+1.234568E+00\r\n',
+                b'-2.000001E-03\r\n', b'aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\r\n']
+    enc = Encoder(window)
+    expect = bytearray()
+    blob = bytearray()
+    for n in range(40):
+        reading = readings[n % len(readings)]
+        reply = replies[n % len(replies)]
+        enc.write(reading)
+        enc.end_block()
+        blob += enc.out
+        enc.out = bytearray()
+        expect += reading
+        blob += reply
+        expect += reply
+    if decode(bytes(blob), bytearray()) != expect:
+        sys.exit('ar488_lzdecode: self test failed (interleaved text)')
+    # Decoding in two parts gives the same result when the history is kept
+    hist = bytearray()
+    half = len(blob) // 2
+    while half < len(blob) and blob[half] != LZ_BLOCK:
+        half += 1
+    out = decode(bytes(blob[:half]), bytearray(), hist)
+    decode(bytes(blob[half:]), out, hist)
+    if out != expect:
+        sys.exit('ar488_lzdecode: self test failed (decoding in parts)')
+    print('self test passed')
+
+
+def main():
+    ap = argparse.ArgumentParser(description='Decode AR488 ++lz output, or benchmark the compression')
+    ap.add_argument('files', nargs='*', help="capture file ('-' for stdin), or files to benchmark")
+    ap.add_argument('--bench', action='store_true', help='compress the files and report the results')
+    ap.add_argument('--test', action='store_true', help='check the decoder against the encoder')
+    ap.add_argument('--window', type=int, default=128, help='LZ_WINDOW used by the firmware (bench)')
+    ap.add_argument('--baud', type=int, default=9600, help='link speed used to estimate times (bench)')
+    ap.add_argument('--block-size', type=int, default=0,
+                    help='bytes per block, e.g. for plotter output received in one transfer (bench, default one block per line)')
+    args = ap.parse_args()
+
+    if args.test:
+        selftest()
+        return
+    if not args.files:
+        ap.error('no files given')
+
+    if args.bench:
+        bench(args.files, args.window, args.baud, args.block_size)
+        return
+
+    for name in args.files:
+        if name == '-':
+            blob = sys.stdin.buffer.read()
+        else:
+            with open(name, 'rb') as f:
+                blob = f.read()
+        try:
+            out = decode(blob, bytearray())
+        except ValueError as err:
+            sys.exit('ar488_lzdecode: %s: %s' % (name, err))
+        sys.stdout.buffer.write(out)
+
+
+if __name__ == '__main__':
+    main()
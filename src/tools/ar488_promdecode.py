@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""
+AR488 promiscuous mode capture decoder
+
+Decodes the binary capture returned by '++prom dump' (firmware compiled
+with PROM_CAPTURE) into a readable bus transaction listing with the
+time between bytes, followed by a summary showing where time was spent.
+
+Usage:
+  ar488_promdecode.py capture.bin
+  ar488_promdecode.py --port /dev/ttyUSB0 [--baud 115200] [--save capture.bin]
+
+With --port the capture is read from the interface directly (requires
+pyserial). Otherwise the capture is read from a file ('-' for stdin).
+A file may hold several captures one after the other, e.g. the windows
+sent by the interface each time the ++ptrig trigger matches.
+"""
+
+import argparse
+import struct
+import sys
+
+HEADER = struct.Struct('<4sBHH')   # "ARPC", version, records, records lost
+RECORD = struct.Struct('<IBB')     # time (us), data byte, flags
+
+PROM_ATN = 0x01
+PROM_EOI = 0x02
+
+UNIVERSAL_CMDS = {
+    0x01: 'GTL', 0x04: 'SDC', 0x05: 'PPC', 0x08: 'GET', 0x09: 'TCT',
+    0x11: 'LLO', 0x14: 'DCL', 0x15: 'PPU', 0x18: 'SPE', 0x19: 'SPD',
+    0x3F: 'UNL', 0x5F: 'UNT',
+}
+
+
+def cmd_name(db):
+    """Name of a byte sent with ATN asserted"""
+    db &= 0x7F
+    if db in UNIVERSAL_CMDS:
+        return UNIVERSAL_CMDS[db]
+    if db < 0x20:
+        return 'CMD'
+    if db < 0x40:
+        return 'LAD %d' % (db - 0x20)
+    if db < 0x60:
+        return 'TAD %d' % (db - 0x40)
+    return 'SAD %d' % (db - 0x60)
+
+
+def data_char(db):
+    if 0x20 <= db < 0x7F:
+        return repr(chr(db))
+    return {0x0A: "'\\n'", 0x0D: "'\\r'"}.get(db, '')
+
+
+def parse(blob, offset=0):
+    """Returns the records, records lost and the offset of the next capture"""
+    if len(blob) - offset < HEADER.size:
+        raise ValueError('capture too short')
+    magic, version, count, lost = HEADER.unpack_from(blob, offset)
+    if magic != b'ARPC':
+        raise ValueError('not an AR488 capture (bad header)')
+    if version != 1:
+        raise ValueError('unsupported capture version %d' % version)
+    need = HEADER.size + count * RECORD.size
+    if len(blob) - offset < need:
+        raise ValueError('capture truncated: %d of %d bytes' % (len(blob) - offset, need))
+    records = [RECORD.unpack_from(blob, offset + HEADER.size + i * RECORD.size) for i in range(count)]
+    return records, lost, offset + need
+
+
+def read_port(port, baud, timeout):
+    import serial  # pyserial
+    with serial.Serial(port, baud, timeout=timeout) as ser:
+        ser.reset_input_buffer()
+        ser.write(b'++prom dump\n')
+        head = ser.read(HEADER.size)
+        if len(head) < HEADER.size:
+            raise ValueError('no reply from interface')
+        count = HEADER.unpack(head)[2]
+        return head + ser.read(count * RECORD.size)
+
+
+def decode(records, lost, out):
+    if lost:
+        out.write('# %d records lost (buffer overwritten) before this capture\n' % lost)
+    if not records:
+        out.write('# capture is empty\n')
+        return
+
+    t0 = records[0][0]
+    prev = t0
+    atn_time = 0
+    data_time = 0
+    data_bytes = 0
+    gaps = []
+
+    out.write('%10s %8s  %-4s %-4s %s\n' % ('time_us', 'delta', 'line', 'byte', 'meaning'))
+    for n, (tstamp, db, flags) in enumerate(records):
+        # 32 bit microsecond counter wraps every ~71 minutes
+        delta = (tstamp - prev) & 0xFFFFFFFF
+        elapsed = (tstamp - t0) & 0xFFFFFFFF
+        prev = tstamp
+        if flags & PROM_ATN:
+            line = 'ATN'
+            meaning = cmd_name(db)
+            atn_time += delta
+        else:
+            line = 'EOI' if flags & PROM_EOI else 'DAT'
+            meaning = data_char(db)
+            data_time += delta
+            data_bytes += 1
+        if n:
+            gaps.append((delta, n))
+        out.write('%10d %8d  %-4s 0x%02X %s\n' % (elapsed, delta, line, db, meaning))
+
+    total = (records[-1][0] - t0) & 0xFFFFFFFF
+    out.write('\n# %d bytes (%d data, %d command) in %d us\n'
+              % (len(records), data_bytes, len(records) - data_bytes, total))
+    out.write('# time before command bytes: %d us, before data bytes: %d us\n' % (atn_time, data_time))
+    if data_bytes and data_time:
+        out.write('# data rate: %.0f bytes/s\n' % (data_bytes * 1e6 / data_time))
+    gaps.sort(reverse=True)
+    if gaps:
+        out.write('# largest gaps (us before byte n):\n')
+        for delta, n in gaps[:5]:
+            out.write('#   %8d  before #%d (%s 0x%02X)\n'
+                      % (delta, n, 'ATN' if records[n][2] & PROM_ATN else 'DAT', records[n][1]))
+
+
+def main():
+    ap = argparse.ArgumentParser(description='Decode an AR488 ++prom dump capture')
+    ap.add_argument('file', nargs='?', help="capture file ('-' for stdin)")
+    ap.add_argument('--port', help='read the capture from the interface on this serial port')
+    ap.add_argument('--baud', type=int, default=115200)
+    ap.add_argument('--timeout', type=float, default=5.0)
+    ap.add_argument('--save', help='also save the raw capture to this file')
+    args = ap.parse_args()
+
+    if args.port:
+        blob = read_port(args.port, args.baud, args.timeout)
+    elif args.file == '-':
+        blob = sys.stdin.buffer.read()
+    elif args.file:
+        with open(args.file, 'rb') as f:
+            blob = f.read()
+    else:
+        ap.error('a capture file or --port is required')
+
+    if args.save:
+        with open(args.save, 'wb') as f:
+            f.write(blob)
+
+    offset = 0
+    window = 0
+    while offset < len(blob):
+        try:
+            records, lost, offset = parse(blob, offset)
+        except ValueError as err:
+            sys.exit('ar488_promdecode: %s' % err)
+        if window:
+            sys.stdout.write('\n')
+        if offset < len(blob) or window:
+            sys.stdout.write('# capture %d\n' % (window + 1))
+        decode(records, lost, sys.stdout)
+        window += 1
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+"""
+AR488 event trace decoder
+
+Decodes the binary trace returned by '++trace dump' (firmware compiled
+with TRACE_RING) into a readable list of events with the time between
+them.
+
+Usage:
+  ar488_tracedecode.py trace.bin
+  ar488_tracedecode.py --port /dev/ttyUSB0 [--baud 115200] [--save trace.bin]
+
+With --port the trace is read from the interface directly (requires
+pyserial). Otherwise it is read from a file ('-' for stdin). Command
+numbers are shown as names using the command table of the sketch
+(--sketch, by default ../AR488/AR488.ino next to this script).
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+HEADER = struct.Struct('<4sBHH')   # "ARTR", version, records, records lost
+RECORD = struct.Struct('<IBBH')    # time (us), event, arg1, arg2
+
+HANDSHAKE_STATES = [
+    'HANDSHAKE_START', 'HANDSHAKE_COMPLETE', 'IFC_ASSERTED', 'ATN_ASSERTED',
+    'WAIT_FOR_DATA', 'READ_DATA', 'DATA_ACCEPTED',
+    'WAIT_FOR_RECEIVER_READY', 'PLACE_DATA', 'DATA_READY', 'RECEIVER_ACCEPTING',
+]
+
+CONTROL_STATES = {
+    0x01: 'CINI', 0x02: 'CIDS', 0x03: 'CCMS', 0x04: 'CTAS', 0x05: 'CLAS',
+    0x06: 'DINI', 0x07: 'DIDS', 0x08: 'DLAS', 0x09: 'DTAS',
+}
+
+UNIVERSAL_CMDS = {
+    0x01: 'GTL', 0x04: 'SDC', 0x05: 'PPC', 0x08: 'GET', 0x09: 'TCT',
+    0x11: 'LLO', 0x14: 'DCL', 0x15: 'PPU', 0x18: 'SPE', 0x19: 'SPD',
+    0x3F: 'UNL', 0x5F: 'UNT',
+}
+
+
+def state_name(val):
+    if val < len(HANDSHAKE_STATES):
+        return HANDSHAKE_STATES[val]
+    return 'state %d' % val
+
+
+def byte_text(db, atn):
+    if atn:
+        db &= 0x7F
+        if db in UNIVERSAL_CMDS:
+            return UNIVERSAL_CMDS[db]
+        if db < 0x20:
+            return 'CMD'
+        if db < 0x40:
+            return 'LAD %d' % (db - 0x20)
+        if db < 0x60:
+            return 'TAD %d' % (db - 0x40)
+        return 'SAD %d' % (db - 0x60)
+    if 0x20 <= db < 0x7F:
+        return repr(chr(db))
+    return {0x0A: "'\\n'", 0x0D: "'\\r'"}.get(db, '')
+
+
+def load_commands(sketch):
+    """Names of the ++ commands in the order of the command table"""
+    try:
+        with open(sketch) as f:
+            src = f.read()
+    except OSError:
+        return []
+    start = src.find('cmdHidx [] =')
+    end = src.find('};', start)
+    if start < 0 or end < 0:
+        return []
+    return re.findall(r'\{\s*"([^"]+)"\s*,', src[start:end])
+
+
+def describe(event, arg1, arg2, commands):
+    if event == 1:
+        flags = []
+        if arg2 & 0x01:
+            flags.append('EOI')
+        if arg2 & 0x02:
+            flags.append('ATN')
+        return 'RX   0x%02X %s %s' % (arg1, byte_text(arg1, arg2 & 0x02), ' '.join(flags))
+    if event == 2:
+        return 'RX   failed at %s' % state_name(arg1)
+    if event == 3:
+        flags = []
+        if arg2 & 0x01:
+            flags.append('EOI')
+        if arg2 & 0x02:
+            flags.append('ATN')
+        return 'TX   0x%02X %s %s' % (arg1, byte_text(arg1, arg2 & 0x02), ' '.join(flags))
+    if event == 4:
+        atn = arg2 & 0x100
+        return 'TX   0x%02X %s%s failed at %s' % (arg2 & 0xFF, byte_text(arg2 & 0xFF, atn),
+                                                ' ATN' if atn else '', state_name(arg1))
+    if event == 5:
+        return 'CTRL %s' % CONTROL_STATES.get(arg1, arg1)
+    if event == 6:
+        return 'ATN  done, status 0x%02X, command 0x%02X' % (arg1, arg2)
+    if event == 7:
+        sec = arg2 & 0xFF
+        direction = {1: 'to listen', 2: 'to talk'}.get(arg2 >> 8, '')
+        return 'ADDR %d%s %s' % (arg1, '' if sec == 0xFF else ',%d' % (sec - 0x60), direction)
+    if event == 8:
+        return 'ADDR unaddressed'
+    if event == 9:
+        name = commands[arg1] if arg1 < len(commands) else '#%d' % arg1
+        return 'CMD  ++%s' % name
+    if event == 10:
+        return 'LINE %s, %d bytes' % ({1: 'command', 2: 'data'}.get(arg1, 'type %d' % arg1), arg2)
+    if event == 11:
+        return 'MARK %d' % arg1
+    return 'event %d %d %d' % (event, arg1, arg2)
+
+
+def parse(blob):
+    if len(blob) < HEADER.size:
+        raise ValueError('trace too short')
+    magic, version, count, lost = HEADER.unpack_from(blob)
+    if magic != b'ARTR':
+        raise ValueError('not an AR488 trace (bad header)')
+    if version != 1:
+        raise ValueError('unsupported trace version %d' % version)
+    need = HEADER.size + count * RECORD.size
+    if len(blob) < need:
+        raise ValueError('trace truncated: %d of %d bytes' % (len(blob), need))
+    records = [RECORD.unpack_from(blob, HEADER.size + i * RECORD.size) for i in range(count)]
+    return records, lost
+
+
+def read_port(port, baud, timeout):
+    import serial  # pyserial
+    with serial.Serial(port, baud, timeout=timeout) as ser:
+        ser.reset_input_buffer()
+        ser.write(b'++trace dump\n')
+        head = ser.read(HEADER.size)
+        if len(head) < HEADER.size:
+            raise ValueError('no reply from interface')
+        count = HEADER.unpack(head)[2]
+        return head + ser.read(count * RECORD.size)
+
+
+def main():
+    default_sketch = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'AR488', 'AR488.ino')
+    ap = argparse.ArgumentParser(description='Decode an AR488 ++trace dump')
+    ap.add_argument('file', nargs='?', help="trace file ('-' for stdin)")
+    ap.add_argument('--port', help='read the trace from the interface on this serial port')
+    ap.add_argument('--baud', type=int, default=115200)
+    ap.add_argument('--timeout', type=float, default=5.0)
+    ap.add_argument('--save', help='also save the raw trace to this file')
+    ap.add_argument('--sketch', default=default_sketch, help='AR488.ino used to name commands')
+    args = ap.parse_args()
+
+    try:
+        if args.port:
+            blob = read_port(args.port, args.baud, args.timeout)
+        elif args.file == '-':
+            blob = sys.stdin.buffer.read()
+        elif args.file:
+            with open(args.file, 'rb') as f:
+                blob = f.read()
+        else:
+            ap.error('a trace file or --port is required')
+        if args.save:
+            with open(args.save, 'wb') as f:
+                f.write(blob)
+        records, lost = parse(blob)
+    except ValueError as err:
+        sys.exit('ar488_tracedecode: %s' % err)
+
+    commands = load_commands(args.sketch)
+    if lost:
+        print('# %d records lost (buffer overwritten) before this trace' % lost)
+    if not records:
+        print('# trace is empty')
+        return
+    t0 = prev = records[0][0]
+    print('%10s %8s  %s' % ('time_us', 'delta', 'event'))
+    for tstamp, event, arg1, arg2 in records:
+        # 32 bit microsecond counter wraps every ~71 minutes
+        print('%10d %8d  %s' % ((tstamp - t0) & 0xFFFFFFFF, (tstamp - prev) & 0xFFFFFFFF,
+                                describe(event, arg1, arg2, commands).rstrip()))
+        prev = tstamp
+
+
+if __name__ == '__main__':
+    main()